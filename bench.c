@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "scene.h"
+
+/*
+  Times updating and culling a scene whose nodes have been scattered through memory by deletion and re-creation, as they would be in a long-running program.
+ */
+
+#define N_NODES 200000
+#define N_TRIALS 5
+#define N_FRAMES 10 // Per trial, the fastest of which is reported
+#define N_PROJECTILES 5000
+
+static HPSnode *nodes[N_NODES];
+static unsigned int rendered;
+
+static void preRender(void *data){}
+static void render(void *data){ rendered++; }
+static void postRender(){}
+
+// Reads what addToQueue reads from every visible node
+static void countVisible(Node *node){
+    HPSnode *n = (HPSnode *) node->data;
+    if (n->pipeline && !n->hasExtension) rendered++;
+}
+
+static double now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Last-level cache misses of this thread, from the hardware counters. Returns -1 where they can't be read, as in many containers and virtual machines */
+static int openCacheMisses(){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static float randomFloat(float range){
+    return ((float) rand() / RAND_MAX - 0.5) * range;
+}
+
+static HPSnode *addNode(HPSscene *scene, HPSpipeline *pipeline, int i){
+    // Every 8th node is top-level, the rest are children of the one before
+    HPSnode *parent = (i % 8 && nodes[i - 1]) ? nodes[i - 1] : (HPSnode *) scene;
+    HPSnode *node = hpsAddNode(parent, NULL, pipeline, NULL);
+    float position[3] = {randomFloat(2000), randomFloat(100), randomFloat(2000)};
+    if (parent != (HPSnode *) scene)
+        position[0] = position[2] = 1;
+    hpsSetNodePosition(node, position);
+    return node;
+}
+
+/* Small nodes that all move every frame, in a scene of their own */
+static void projectiles(void *interface, char *name){
+    static HPSnode *projectiles[N_PROJECTILES];
+    static float velocities[N_PROJECTILES][3];
+    int i, frame, trial;
+    double t, best = INFINITY;
+    hpsPartitionInterface = interface;
+    HPSscene *scene = hpsMakeScene();
+    HPSpipeline *pipeline = hpsAddPipeline(preRender, render, postRender, false);
+    for (i = 0; i < N_PROJECTILES; i++){
+        float position[3] = {randomFloat(1000), randomFloat(100), randomFloat(1000)};
+        projectiles[i] = hpsAddNode((HPSnode *) scene, NULL, pipeline, NULL);
+        hpsSetNodePosition(projectiles[i], position);
+        hpsSetNodeBoundingSphere(projectiles[i], 0.5);
+        velocities[i][0] = randomFloat(10);
+        velocities[i][1] = randomFloat(1);
+        velocities[i][2] = randomFloat(10);
+    }
+    HPScamera *camera = hpsMakeCamera(HPS_PERSPECTIVE, HPS_FIRST_PERSON, scene, 800, 600);
+    hpsUpdateScenes();
+    for (trial = 0; trial < N_TRIALS; trial++){
+        t = now();
+        for (frame = 0; frame < N_FRAMES; frame++){
+            for (i = 0; i < N_PROJECTILES; i++)
+                hpsMoveNode(projectiles[i], velocities[i]);
+            hpsUpdateScenes();
+            hpsUpdateCamera(camera);
+            hpsRenderCamera(camera);
+        }
+        best = fmin(best, now() - t);
+        // Turn around, so that the projectiles stay in the same region
+        for (i = 0; i < N_PROJECTILES; i++){
+            velocities[i][0] = -velocities[i][0];
+            velocities[i][1] = -velocities[i][1];
+            velocities[i][2] = -velocities[i][2];
+        }
+    }
+    printf("Projectiles, %-13s %8.2f ns/projectile (%d moving every frame)\n", name,
+           best * 1e9 / N_FRAMES / N_PROJECTILES, N_PROJECTILES);
+    hpsDeleteCamera(camera);
+    hpsDeleteScene(scene);
+    hpsDeletePipeline(pipeline);
+}
+
+static void scatter(HPSscene *scene, HPSpipeline *pipeline){
+    int i;
+    for (i = 0; i < N_NODES; i += 8)
+        if (rand() % 2){
+            hpsDeleteNode(nodes[i]);
+            nodes[i] = NULL;
+        }
+    hpsUpdateScenes();
+    for (i = 0; i < N_NODES; i += 8)
+        if (!nodes[i]){
+            int j;
+            for (j = i; j < i + 8; j++)
+                nodes[j] = addNode(scene, pipeline, j);
+        }
+}
+
+int main(){
+    int i, frame, trial;
+    double t, best;
+    srand(1);
+    hpsNodePoolSize = N_NODES;
+    hpsInit();
+    HPSscene *scene = hpsMakeScene();
+    HPSpipeline *pipeline = hpsAddPipeline(preRender, render, postRender, false);
+    for (i = 0; i < N_NODES; i++)
+        nodes[i] = addNode(scene, pipeline, i);
+    scatter(scene, pipeline);
+    hpsUpdateScenes();
+    HPScamera *camera = hpsMakeCamera(HPS_PERSPECTIVE, HPS_FIRST_PERSON, scene, 800, 600);
+    hpsUpdateCamera(camera);
+    // Partitions are restructured as they are culled and maintained over the first frames
+    for (frame = 0; frame < N_FRAMES; frame++){
+        hpsRenderCamera(camera);
+        hpsUpdateScenes();
+    }
+
+    printf("%d nodes, node size %zu bytes\n", N_NODES, sizeof(HPSnode));
+
+    size_t cellBytes = 0, heapBytes = 0;
+    size_t cells = hpsAABBmemoryUse(scene->partitionStruct, &cellBytes, &heapBytes);
+    printf("AABB tree:       %zu cells of %zu bytes, %.1f MB in cells, %.1f MB on the heap\n",
+           cells, cellBytes / cells, cellBytes / 1e6, heapBytes / 1e6);
+
+    best = INFINITY;
+    for (trial = 0; trial < N_TRIALS; trial++){
+        t = now();
+        for (frame = 0; frame < N_FRAMES; frame++)
+            hpsUpdateScenes();
+        best = fmin(best, now() - t);
+    }
+    printf("Clean update:    %8.2f ns/node\n", best * 1e9 / N_FRAMES / N_NODES);
+
+    float move[3] = {0.01, 0, 0};
+    best = INFINITY;
+    for (trial = 0; trial < N_TRIALS; trial++){
+        t = now();
+        for (frame = 0; frame < N_FRAMES; frame++){
+            for (i = 0; i < N_NODES; i += 8)
+                hpsMoveNode(nodes[i], move);
+            hpsUpdateScenes();
+        }
+        best = fmin(best, now() - t);
+    }
+    printf("Dirty update:    %8.2f ns/node\n", best * 1e9 / N_FRAMES / N_NODES);
+
+    View view;
+    hpsCameraViewVolume(camera, &view);
+    int misses = openCacheMisses();
+    long long nMisses = 0;
+    unsigned long totalVisible = 0;
+    best = INFINITY;
+    if (misses >= 0){
+        ioctl(misses, PERF_EVENT_IOC_RESET, 0);
+        ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    for (trial = 0; trial < N_TRIALS; trial++){
+        rendered = 0;
+        t = now();
+        for (frame = 0; frame < N_FRAMES; frame++)
+            scene->partitionInterface->doVisible(scene->partitionStruct, &view,
+                                                 countVisible);
+        best = fmin(best, (now() - t) / rendered);
+        totalVisible += rendered;
+    }
+    printf("Cull:            %8.2f ns/visible node\n", best * 1e9);
+    if (misses >= 0){
+        ioctl(misses, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(misses, &nMisses, sizeof(nMisses)) == sizeof(nMisses))
+            printf("Cull:            %8.2f cache misses/visible node\n",
+                   (double) nMisses / totalVisible);
+        close(misses);
+    } else {
+        printf("Cull:            cache misses unavailable (no hardware counters)\n");
+    }
+
+    best = INFINITY;
+    for (trial = 0; trial < N_TRIALS; trial++){
+        rendered = 0;
+        t = now();
+        for (frame = 0; frame < N_FRAMES; frame++){
+            hpsYawCamera(camera, 6.283 / N_FRAMES);
+            hpsUpdateCamera(camera);
+            hpsRenderCamera(camera);
+        }
+        best = fmin(best, (now() - t) / rendered);
+    }
+    printf("Cull and render: %8.2f ns/visible node (%u visible per frame)\n",
+           best * 1e9, rendered / N_FRAMES);
+
+    hpsDeactivateScene(scene);
+    projectiles(hpsAABBpartitionInterface, "AABB tree:");
+    projectiles(hpsLooseOctreePartitionInterface, "loose octree:");
+    projectiles(hpsBVHpartitionInterface, "BVH:");
+    projectiles(hpsHashGridPartitionInterface, "hash grid:");
+    projectiles(hpsQuadtreePartitionInterface, "quadtree:");
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stddef.h>
 
 #define HPS_DEFAULT_NEAR_PLANE 1.0
 #define HPS_DEFAULT_FAR_PLANE 10000.0
@@ -12,11 +13,30 @@ typedef enum {
     HPS_POSITION, HPS_LOOK_AT, HPS_ORBIT, HPS_FIRST_PERSON
 } HPScameraStyle;
 
+typedef enum {
+    HPS_UPDATE_EVERY_FRAME, HPS_UPDATE_EVERY_2ND_FRAME, HPS_UPDATE_EVERY_4TH_FRAME,
+    HPS_UPDATE_EVERY_8TH_FRAME, HPS_UPDATE_BY_DISTANCE
+} HPSupdateRate;
+
+typedef enum {
+    HPS_CONSTRAINT_NONE, HPS_CONSTRAINT_LOOK_AT, HPS_CONSTRAINT_FOLLOW,
+    HPS_CONSTRAINT_BILLBOARD, HPS_CONSTRAINT_AXIAL_BILLBOARD
+} HPSconstraint;
+
+typedef enum {
+    HPS_X_AXIS, HPS_Y_AXIS, HPS_Z_AXIS
+} HPSaxis;
+
 typedef struct node HPSnode;
 typedef struct scene HPSscene;
 typedef struct camera HPScamera;
 typedef struct pipeline HPSpipeline;
 typedef struct partitionInterface HPSpartitionInterface;
+typedef struct snapshot HPSsnapshot;
+typedef struct sharedScene HPSsharedScene;
+typedef struct prefab HPSprefab;
+
+typedef struct skeleton HPSskeleton;
 
 typedef struct HPSextension {
     void (*init)(void **);
@@ -41,6 +61,8 @@ HPSnode *hpsAddNode(HPSnode *parent, void *data,
 
 void hpsDeleteNode(HPSnode *node);
 
+void hpsQueueNodeDeletion(HPSnode *node);
+
 void hpsSetNodeBoundingSphere(HPSnode *node, float radius);
 
 float *hpsNodeBoundingSphere(HPSnode *node);
@@ -59,6 +81,26 @@ float* hpsNodeTransform(HPSnode *node);
 
 void* hpsNodeData(HPSnode *node);
 
+unsigned int hpsNodeSlot(HPSnode *node);
+
+void hpsSetNodeUpdateRate(HPSnode *node, HPSupdateRate rate);
+
+void hpsSetNodeConstraint(HPSnode *node, HPSconstraint type, HPSnode *target, float *vector);
+
+void hpsSetNodeMaxDistance(HPSnode *node, float distance);
+
+void hpsSetNodeHLOD(HPSnode *group, void *data, HPSpipeline *pipeline, float threshold);
+
+int hpsAddNodeLOD(HPSnode *node, void *data, HPSpipeline *pipeline, float size);
+
+void hpsClearNodeLODs(HPSnode *node);
+
+unsigned int hpsNodeLOD(HPSnode *node);
+
+unsigned int hpsNodeLastVisible(HPSnode *node);
+
+unsigned int hpsNodeVisibleMask(HPSnode *node);
+
 HPSscene *hpsMakeScene();
 
 void hpsDeleteScene(HPSscene *scene);
@@ -69,6 +111,108 @@ void hpsDeactivateScene(HPSscene *s);
 
 void hpsUpdateScenes();
 
+extern unsigned int hpsPartitionMaintenanceBudget;
+
+void hpsMaintainPartitions(unsigned int budget);
+
+void hpsSetUpdateDistances(HPSscene *scene, HPScamera *camera,
+                           float every2nd, float every4th, float every8th);
+
+unsigned int *hpsChangedTransforms(HPSscene *scene, unsigned int *n);
+
+float *hpsTransformChunk(HPSscene *scene, unsigned int chunk,
+                         unsigned int *first, unsigned int *n);
+
+unsigned int hpsSceneFrame(HPSscene *scene);
+
+HPSnode **hpsNewlyHiddenNodes(HPSscene *scene, unsigned int *n);
+
+/* Scene files */
+// Returns false without writing anything if the scene has prefab instances, skeletons, nodes with levels of detail, HLOD groups, or constrained nodes
+bool hpsSaveScene(HPSscene *scene, const char *path,
+                  HPSpipeline **pipelines, unsigned int nPipelines,
+                  unsigned int (*dataID)(void *));
+
+HPSscene *hpsLoadScene(const char *path,
+                       HPSpipeline **pipelines, unsigned int nPipelines,
+                       HPSextension **extensions, unsigned int nExtensions,
+                       void *(*loadData)(unsigned int),
+                       void (*deleteFunc)(void *));
+
+/* Shared scenes */
+size_t hpsSharedSceneSize(unsigned int nNodes);
+
+HPSscene *hpsMakeSceneInRegion(void *region, size_t size);
+
+void *hpsCreateSharedRegion(const char *name, size_t size);
+
+void hpsDeleteSharedRegion(const char *name, void *region, size_t size);
+
+HPSsharedScene *hpsOpenSharedScene(const char *name);
+
+void hpsCloseSharedScene(HPSsharedScene *scene);
+
+unsigned int hpsSharedSceneReadBegin(HPSsharedScene *scene);
+
+bool hpsSharedSceneReadValid(HPSsharedScene *scene, unsigned int sequence);
+
+unsigned int hpsSharedSceneSlots(HPSsharedScene *scene);
+
+float *hpsSharedSceneTransforms(HPSsharedScene *scene);
+
+float *hpsSharedSceneBoundingSpheres(HPSsharedScene *scene);
+
+unsigned char *hpsSharedSceneLiveSlots(HPSsharedScene *scene);
+
+/* Snapshots */
+HPSsnapshot *hpsSnapshotScene(HPSscene *scene);
+
+void hpsRestoreScene(HPSscene *scene, HPSsnapshot *snapshot);
+
+void hpsDeleteSnapshot(HPSsnapshot *snapshot);
+
+/* Replication */
+extern float hpsReplicationPrecision;
+
+void hpsSetNodeNetworkID(HPSnode *node, unsigned int id);
+
+unsigned int hpsNodeNetworkID(HPSnode *node);
+
+size_t hpsEncodeSceneDelta(HPSscene *scene, HPSsnapshot *baseline,
+                           unsigned char *buffer, size_t size);
+
+bool hpsApplySceneDelta(const unsigned char *buffer, size_t size,
+                        HPSnode *(*lookup)(unsigned int, void *), void *data);
+
+/* Prefabs */
+HPSprefab *hpsMakePrefab();
+
+void hpsDeletePrefab(HPSprefab *prefab);
+
+int hpsAddPrefabPart(HPSprefab *prefab, int parent, void *data, HPSpipeline *pipeline,
+                     float *position, float *rotation, float radius);
+
+HPSnode *hpsAddPrefabInstance(HPSnode *parent, HPSprefab *prefab, void *data,
+                              void (*deleteFunc)(void *));
+
+void hpsOverridePrefabPart(HPSnode *instance, int part, void *data, HPSpipeline *pipeline);
+
+void hpsPrefabPartTransform(HPSnode *instance, int part, float *dest);
+
+/* Skeletons */
+HPSskeleton *hpsMakeSkeleton(unsigned int nBones, int *parents, float *inverseBindMatrices);
+
+void hpsDeleteSkeleton(HPSskeleton *skeleton);
+
+HPSnode *hpsAddSkeletonInstance(HPSnode *parent, HPSskeleton *skeleton, float radius,
+                                void *data, HPSpipeline *pipeline,
+                                void (*deleteFunc)(void *));
+
+void hpsSetBonePose(HPSnode *node, unsigned int bone, float *position, float *rotation,
+                    float scale);
+
+float *hpsSkeletonPalette(HPSnode *node, unsigned int *nBones);
+
 /* Pipelines */
 HPSpipeline *hpsAddPipeline(void (*preRender)(void *),
 			    void (*render)(void *),
@@ -82,6 +226,8 @@ HPScamera *hpsCurrentCamera();
 
 float *hpsCurrentInverseTransposeModel();
 
+float *hpsCurrentBonePalette(unsigned int *nBones);
+
 float *hpsCurrentCameraPosition();
 
 float *hpsCurrentCameraView();
@@ -96,6 +242,8 @@ void hpsUpdateCamera(HPScamera *camera);
 
 void hpsRenderCamera(HPScamera *camera);
 
+void hpsCullCameras(HPScamera **cameras, unsigned int n);
+
 HPScamera *hpsMakeCamera(HPScameraType type, HPScameraStyle style, HPSscene *scene, float width, float height);
 
 void hpsSetCameraClipPlanes(HPScamera *camera, float near, float far);
@@ -152,6 +300,10 @@ float *hpsCameraView(HPScamera *camera);
 
 float *hpsCameraViewProjection(HPScamera *camera);
 
+unsigned int hpsCameraMask(HPScamera *camera);
+
+void hpsSetCameraMinSize(HPScamera *camera, float size);
+
 void hpsResizeCameras(float width, float height);
 
 void hpsRenderCameras();
@@ -167,6 +319,34 @@ extern void *hpsAABBpartitionInterface;
 
 extern unsigned int hpsAABBpartitionPoolSize;
 
+extern void *hpsLooseOctreePartitionInterface;
+
+extern float hpsLooseOctreeSize;
+
+extern unsigned int hpsLooseOctreeDepth;
+
+extern unsigned int hpsLooseOctreePoolSize;
+
+extern void *hpsBVHpartitionInterface;
+
+extern unsigned int hpsBVHpartitionPoolSize;
+
+extern void *hpsHashGridPartitionInterface;
+
+extern float hpsHashGridCellSize;
+
+extern unsigned int hpsHashGridPoolSize;
+
+extern void *hpsQuadtreePartitionInterface;
+
+extern unsigned int hpsQuadtreeAxis;
+
+extern float hpsQuadtreeSize;
+
+extern unsigned int hpsQuadtreeLeafNodes;
+
+extern unsigned int hpsQuadtreePoolSize;
+
 /* Extensions */
 void hpsActivateExtension(HPSscene *scene, HPSextension *extension);
 
@@ -14,9 +14,13 @@
 
 #define SPLIT_DIR_THRESHOLD 4
 #define SPLIT_THRESHOLD 30 
-#define TREE_NODES 45
+#define TREE_NODES 8 // Nodes held in the cell itself, more are stored on the heap
+#define TREE_CHILDREN 4 // Children held in the cell itself, more are stored on the heap
+#define LARGE_NODES 45 // Nodes too large for any child that a split tree keeps, before it passes the rest down
 
 #define ALL_PLANES 63 // bx111111
+#define SPHERE_BATCH 4 // Spheres tested against the planes at once
+#define MAX_CAMERAS 32 // Cameras with their own plane hints
 
 typedef enum {
     INSIDE, OUTSIDE, INTERSECT
@@ -28,37 +32,54 @@ typedef struct {
 
 typedef struct aabbTree {
     struct aabbTree *parent;
-    struct aabbTree *children[27];
+    struct aabbTree **children; // Packed in order of their position, which is given by childMask
     HPSpool pool;
-    unsigned short split, lastChecked;
+    unsigned int childMask; // Bit i is set when there is a child at position i, of 27
+    unsigned short split;
     Point splitPoint;
     Point min;
     Point max;
-    bool extentsCorrect;
+    float maxDistance; // Greatest maxDistance of the nodes in the tree and its children
+    float nearestMaxDistance; // Smallest maxDistance of the tree's own nodes
+    bool extentsCorrect, needsSweep;
+    bool needsSplit; // Set by culling, when the tree was tested while holding too many nodes
+    bool needsMaintenance; // Whether the tree or one of its children has pending work
+    unsigned char planeHints[MAX_CAMERAS]; // For each camera, the plane the tree was last found outside of. Cameras past the 31st share the last
     HPSvector nodes;
+    float *spheres; // Copies of the nodes' bounding spheres: x, y, z, and r arrays of nodes.capacity floats each
+    struct aabbTree *childrenData[TREE_CHILDREN];
     Node *nodesData[TREE_NODES];
+    float spheresData[4 * TREE_NODES];
 } AABBtree;
 
 AABBtree *hpsAABBnewTree();
 void hpsAABBdeleteTree(AABBtree *tree);
 AABBtree *hpsAABBfindNode(Node *node, AABBtree *tree);
 void hpsAABBaddNode(Node *node, AABBtree *tree);
+void hpsAABBaddNodes(Node **nodes, size_t n, AABBtree *tree);
 void hpsAABBremoveNode(Node *node);
+void hpsAABBremoveNodes(Node **nodes, size_t n);
 void hpsAABBupdateNode(Node *node);
-void hpsAABBdoVisible(AABBtree *tree, Plane *planes, void (*func)(Node *));
-static void getAABBtreeExtents(AABBtree *tree, Point *min, Point *max);
+void hpsAABBdoVisible(AABBtree *tree, View *view, void (*func)(Node *));
+unsigned int hpsAABBmaintain(AABBtree *tree, unsigned int budget);
+void hpsAABBdoVisibleViews(AABBtree *tree, View *views, unsigned int n,
+                           void (*func)(Node *, unsigned int));
 static AABBtree *newTree(HPSpool pool, AABBtree *parent);
 static void splitTree(AABBtree *tree);
 static void updateExtents(AABBtree *tree);
 static AABBtree *whichBranch(AABBtree *tree, BoundingSphere *bs);
-static void growExtents(AABBtree *tree, BoundingSphere *bs);
+static void growExtents(AABBtree *tree, Node *node);
 static void shrinkExtents(AABBtree *tree, BoundingSphere *bs);
+static void invalidateExtents(AABBtree *tree);
+static void queueMaintenance(AABBtree *tree);
 static void maybeKillTree(AABBtree *tree);
 static void deleteTree(AABBtree *tree);
 static bool contains(AABBtree *t, BoundingSphere *bs);
 
 unsigned int hpsAABBpartitionPoolSize = 4096;
 
+static HPSvector sweepTrees; // Trees touched by hpsAABBremoveNodes
+
 #ifdef DEBUG
 void printTree(AABBtree *tree){
     printf("Tree %p [(%f %f) (%f %f) (%f %f)]", tree,
@@ -71,10 +92,15 @@ void printTree(AABBtree *tree){
 PartitionInterface partitionInterface = {(void *(*)()) hpsAABBnewTree,
                                          (void (*)(void *)) hpsAABBdeleteTree,
                                          (void (*)(Node *, void *)) hpsAABBaddNode,
+                                         (void (*)(Node **, size_t, void *)) hpsAABBaddNodes,
                                          (void (*)(Node *)) hpsAABBremoveNode,
+                                         (void (*)(Node **, size_t)) hpsAABBremoveNodes,
                                          (void (*)(Node *)) hpsAABBupdateNode,
-                                         (void (*)(void *, Plane *, void (*)(Node *))) 
-                                           hpsAABBdoVisible};
+                                         (void (*)(void *, View *, void (*)(Node *))) 
+                                           hpsAABBdoVisible,
+                                         (unsigned int (*)(void *, unsigned int)) hpsAABBmaintain,
+                                         (void (*)(void *, View *, unsigned int, void (*)(Node *, unsigned int)))
+                                           hpsAABBdoVisibleViews};
 
 PartitionInterface *hpsAABBpartitionInterface = &partitionInterface;
 
@@ -86,21 +112,61 @@ AABBtree *hpsAABBnewTree(){
 }
 
 void hpsAABBdeleteTree(AABBtree *tree){
-    hpsDeletePool(tree->pool);
+    HPSpool pool = tree->pool;
+    deleteTree(tree);
+    hpsDeletePool(pool);
 }
 
 static AABBtree *newTree(HPSpool pool, AABBtree *parent){
     AABBtree *tree = hpsAllocateFrom(pool);
     hpsInitStaticVector(&tree->nodes, tree->nodesData, TREE_NODES);
+    tree->spheres = tree->spheresData;
     tree->parent = parent;
     tree->pool = pool;
     tree->split = 0;
-    tree->lastChecked = 0;
-    tree->extentsCorrect = false;
-    memset(tree->children, 0, 27 * sizeof(void *));
+    memset(tree->planeHints, 0, sizeof(tree->planeHints));
+    tree->maxDistance = -INFINITY;
+    tree->nearestMaxDistance = INFINITY;
+    // An empty tree's extents are empty, and grow with each node added
+    tree->min.x = tree->min.y = tree->min.z = INFINITY;
+    tree->max.x = tree->max.y = tree->max.z = -INFINITY;
+    tree->extentsCorrect = true;
+    tree->needsSweep = false;
+    tree->needsSplit = false;
+    tree->needsMaintenance = false;
+    tree->children = tree->childrenData;
+    tree->childMask = 0;
     return tree;
 }
 
+/* Children */
+static int nChildren(AABBtree *tree){
+    return __builtin_popcount(tree->childMask);
+}
+
+static int childIndex(AABBtree *tree, int position){
+    return __builtin_popcount(tree->childMask & ((1u << position) - 1));
+}
+
+static AABBtree *getChild(AABBtree *tree, int position){
+    if (tree->childMask & (1u << position))
+        return tree->children[childIndex(tree, position)];
+    return NULL;
+}
+
+static AABBtree *addChild(AABBtree *tree, int position){
+    int n = nChildren(tree), i = childIndex(tree, position);
+    AABBtree *child = newTree(tree->pool, tree);
+    if (n == TREE_CHILDREN){
+        tree->children = malloc(27 * sizeof(AABBtree *));
+        memcpy(tree->children, tree->childrenData, n * sizeof(AABBtree *));
+    }
+    memmove(&tree->children[i + 1], &tree->children[i], (n - i) * sizeof(AABBtree *));
+    tree->children[i] = child;
+    tree->childMask |= 1u << position;
+    return child;
+}
+
 AABBtree *hpsAABBfindNode(Node *node, AABBtree *tree){
     AABBtree *t = tree;
     AABBtree *u = NULL;
@@ -111,9 +177,92 @@ AABBtree *hpsAABBfindNode(Node *node, AABBtree *tree){
     return t;
 }
 
+/* Leaf spheres */
+static void setSphere(AABBtree *tree, int i, BoundingSphere *bs){
+    unsigned int c = tree->nodes.capacity;
+    float *s = tree->spheres;
+    s[i] = bs->x;
+    s[c + i] = bs->y;
+    s[2 * c + i] = bs->z;
+    s[3 * c + i] = bs->r;
+}
+
+static void copySphere(AABBtree *tree, int from, int to){
+    unsigned int c = tree->nodes.capacity;
+    float *s = tree->spheres;
+    int j;
+    for (j = 0; j < 4; j++)
+        s[j * c + to] = s[j * c + from];
+}
+
+/* Called once a push has grown the node vector, before the pushed node's sphere is set */
+static void growSpheres(AABBtree *tree, unsigned int oldCapacity){
+    unsigned int c = tree->nodes.capacity;
+    float *spheres = malloc(4 * c * sizeof(float));
+    int j;
+    for (j = 0; j < 4; j++)
+        memcpy(&spheres[j * c], &tree->spheres[j * oldCapacity],
+               (tree->nodes.size - 1) * sizeof(float));
+    if (tree->spheres != tree->spheresData) free(tree->spheres);
+    tree->spheres = spheres;
+}
+
+/* Leaf storage that is no longer needed is given back: nodes return to the cell once they fit in it, otherwise the heap storage is cut to twice what is used */
+static void fitNodes(AABBtree *tree){
+    HPSvector *v = &tree->nodes;
+    unsigned int n = v->size, c = v->capacity, capacity;
+    void **data;
+    float *spheres;
+    int j;
+    if (v->isStatic || n * 4 > c) return;
+    if (n <= TREE_NODES){
+        capacity = TREE_NODES;
+        data = (void **) tree->nodesData;
+        spheres = tree->spheresData;
+    } else {
+        capacity = n * 2;
+        data = malloc(capacity * sizeof(void *));
+        spheres = malloc(4 * capacity * sizeof(float));
+    }
+    memcpy(data, v->data, n * sizeof(void *));
+    for (j = 0; j < 4; j++)
+        memcpy(&spheres[j * capacity], &tree->spheres[j * c], n * sizeof(float));
+    free(v->data);
+    free(tree->spheres);
+    v->data = data;
+    v->capacity = capacity;
+    v->isStatic = (n <= TREE_NODES);
+    tree->spheres = spheres;
+}
+
+/* Each node's slot is its index in its tree's nodes, kept up to date as nodes are added, removed, and moved between trees */
+static int nodeIndex(AABBtree *tree, Node *node){
+    if (node->slot < tree->nodes.size && tree->nodes.data[node->slot] == node)
+        return node->slot;
+    return -1;
+}
+
+static void removeNth(AABBtree *tree, int n){
+    int i;
+    for (i = n + 1; i < tree->nodes.size; i++){
+        Node *node = tree->nodes.data[i];
+        tree->nodes.data[i - 1] = node;
+        node->slot = i - 1;
+        copySphere(tree, i, i - 1);
+    }
+    tree->nodes.size--;
+    fitNodes(tree);
+}
+
 void addNode(Node *node, AABBtree *tree){
+    unsigned int capacity = tree->nodes.capacity;
     hpsPush(&tree->nodes, node);
+    if (tree->nodes.capacity != capacity)
+        growSpheres(tree, capacity);
+    setSphere(tree, tree->nodes.size - 1, node->boundingSphere);
     node->area = (void *) tree;
+    node->slot = tree->nodes.size - 1;
+    tree->nearestMaxDistance = fmin(tree->nearestMaxDistance, node->maxDistance);
 #ifdef DEBUG
     printf("Added node %p to tree %p\n", node->data, tree);
 #endif
@@ -122,12 +271,27 @@ void addNode(Node *node, AABBtree *tree){
 void hpsAABBaddNode(Node *node, AABBtree *tree){
     AABBtree *t = hpsAABBfindNode(node, tree);
     addNode(node, t);
-    growExtents(tree, node->boundingSphere);
+    growExtents(t, node);
+}
+
+/* An empty tree takes the whole batch and computes its extents once. It is then split like any other tree that has grown too large */
+void hpsAABBaddNodes(Node **nodes, size_t n, AABBtree *tree){
+    size_t i;
+    if (tree->split || tree->nodes.size){
+        for (i = 0; i < n; i++)
+            hpsAABBaddNode(nodes[i], tree);
+        return;
+    }
+    for (i = 0; i < n; i++)
+        addNode(nodes[i], tree);
+    updateExtents(tree);
 }
 
 void hpsAABBremoveNode(Node *node){
     AABBtree *tree = (AABBtree *) node->area;
-    if (hpsRemove(&tree->nodes, (void *) node)){
+    int i = nodeIndex(tree, node);
+    if (i >= 0){
+        removeNth(tree, i);
 	shrinkExtents(tree, node->boundingSphere);
 	maybeKillTree(tree);
     } else {
@@ -155,6 +319,50 @@ void hpsAABBremoveNode(Node *node){
     }
 }
 
+static int treeDepth(AABBtree *tree){
+    int depth = 0;
+    while ((tree = tree->parent)) depth++;
+    return depth;
+}
+
+static int shallowerTree(const void *a, const void *b){
+    return treeDepth(*((AABBtree **) a)) - treeDepth(*((AABBtree **) b));
+}
+
+/* Batch removal: Nodes are marked by clearing their area, then each tree they belonged to is swept once. Trees are only killed after every sweep, shallowest first, so that a tree is never killed while it is still in the sweep list */
+void hpsAABBremoveNodes(Node **nodes, size_t n){
+    size_t i;
+    int j, k;
+    for (i = 0; i < n; i++){
+        AABBtree *tree = (AABBtree *) nodes[i]->area;
+        if (!tree->needsSweep){
+            tree->needsSweep = true;
+            hpsPush(&sweepTrees, tree);
+        }
+        nodes[i]->area = NULL;
+    }
+    for (i = 0; i < sweepTrees.size; i++){
+        AABBtree *tree = sweepTrees.data[i];
+        HPSvector *v = &tree->nodes;
+        for (j = 0, k = 0; j < v->size; j++){
+            Node *node = v->data[j];
+            if (node->area){
+                copySphere(tree, j, k);
+                node->slot = k;
+                v->data[k++] = node;
+            }
+        }
+        v->size = k;
+        fitNodes(tree);
+        tree->needsSweep = false;
+        invalidateExtents(tree);
+    }
+    qsort(sweepTrees.data, sweepTrees.size, sizeof(void *), &shallowerTree);
+    for (i = 0; i < sweepTrees.size; i++)
+        maybeKillTree(sweepTrees.data[i]);
+    sweepTrees.size = 0;
+}
+
 void hpsAABBupdateNode(Node *node){
     AABBtree *tree = (AABBtree *) node->area;
     AABBtree *t = tree;
@@ -165,22 +373,14 @@ void hpsAABBupdateNode(Node *node){
     if (t != tree){
 	hpsAABBremoveNode(node);
 	addNode(node, t);
-        growExtents(t, node->boundingSphere);
+        growExtents(t, node);
     } else {
-	growExtents(t, node->boundingSphere);
+        setSphere(t, node->slot, node->boundingSphere);
+	growExtents(t, node);
 	shrinkExtents(t, node->boundingSphere);
     }
 }
 
-static void getAABBtreeExtents(AABBtree *tree, Point *min, Point *max){
-    if (!tree->extentsCorrect)
-	updateExtents(tree);
-    if (!tree->split && (tree->nodes.size >= SPLIT_THRESHOLD))
-	splitTree(tree);
-    *min = tree->min;
-    *max = tree->max;
-}
-
 static bool contains(AABBtree *t, BoundingSphere *bs){
     return (bs->x - bs->r >= t->min.x &&
 	    bs->y - bs->r >= t->min.y &&
@@ -190,9 +390,12 @@ static bool contains(AABBtree *t, BoundingSphere *bs){
 	    bs->z + bs->r <= t->max.z);
 }
 
-static void growExtents(AABBtree *tree, BoundingSphere *bs){
+static void growExtents(AABBtree *tree, Node *node){
     AABBtree *t = tree;
+    BoundingSphere *bs = node->boundingSphere;
+    tree->nearestMaxDistance = fmin(tree->nearestMaxDistance, node->maxDistance);
     do {
+	t->maxDistance = fmax(t->maxDistance, node->maxDistance);
 	t->max.x = fmax(t->max.x, bs->x + bs->r);
 	t->max.y = fmax(t->max.y, bs->y + bs->r);
 	t->max.z = fmax(t->max.z, bs->z + bs->r);
@@ -211,32 +414,44 @@ static void shrinkExtents(AABBtree *tree, BoundingSphere *bs){
 	    bs->z - bs->r <= t->min.z ||
 	    bs->x + bs->r >= t->max.x ||
 	    bs->y + bs->r >= t->max.y ||
-	    bs->z + bs->r >= t->max.z)
+	    bs->z + bs->r >= t->max.z){
 	    t->extentsCorrect = false;
+            queueMaintenance(t);
+        }
     } while ((t = t->parent));
 }
 
+static void invalidateExtents(AABBtree *tree){
+    AABBtree *t = tree;
+    do {
+	t->extentsCorrect = false;
+    } while ((t = t->parent));
+    queueMaintenance(tree);
+}
+
 static void removeChild(AABBtree *tree, AABBtree *c){
-    bool unsplit = true;
-    int i;
-    for (i = 0; i < 27; i++){
-	AABBtree *child = tree->children[i];
-	if (child){
-	    if (child == c)
-		tree->children[i] = NULL;
-	    else
-		unsplit = false;
-	}
+    int n = nChildren(tree), i, j;
+    unsigned int mask = tree->childMask;
+    for (i = 0; i < n && tree->children[i] != c; i++);
+    if (i < n){
+        // Clear the bit of the ith child
+        for (j = 0; j < i; j++)
+            mask &= mask - 1;
+        tree->childMask &= ~(mask & -mask);
+        memmove(&tree->children[i], &tree->children[i + 1], (n - i - 1) * sizeof(AABBtree *));
+        if (n - 1 == TREE_CHILDREN){
+            memcpy(tree->childrenData, tree->children, TREE_CHILDREN * sizeof(AABBtree *));
+            free(tree->children);
+            tree->children = tree->childrenData;
+        }
     }
-    if (unsplit) tree->split = 0;
+    if (!tree->childMask) tree->split = 0;
     maybeKillTree(tree);
 }
 
 static void maybeKillTree(AABBtree *tree){
-    int i;
     if (tree->parent && tree->nodes.size == 0){
-	for (i = 0; i < 27; i++)
-	    if (tree->children[i]) return;
+	if (tree->childMask) return;
 #ifdef DEBUG
         printf("Killing tree ");
         printTree(tree);
@@ -254,7 +469,7 @@ static AABBtree *whichBranch(AABBtree *tree, BoundingSphere *bs){
 	(tree->max.y - tree->min.y) * (tree->max.z - tree->min.z);
     if (!tree->split ||
 	(tree->extentsCorrect && (ov > bv/8) &&
-	 (tree->nodes.size != tree->nodes.capacity)))
+	 (tree->nodes.size < LARGE_NODES)))
 	return tree;
     int x = 0, y =0, z = 0;
     if (tree->split & SPLIT_X){
@@ -279,21 +494,19 @@ static AABBtree *whichBranch(AABBtree *tree, BoundingSphere *bs){
 	else z = 1;
     }
     int i = x + y*3 + z*9;
-    if (tree->children[i])
-	return tree->children[i];
-    else
-	return tree->children[i] = newTree(tree->pool, tree);
+    AABBtree *child = getChild(tree, i);
+    return child ? child : addChild(tree, i);
 }
 
 static void setSplitLocation(AABBtree *tree){
     float x = 0, y = 0, z= 0;
     int i;
-    for (i = 0; i < tree->nodes.size; i++){
-	BoundingSphere *bs =
-	    ((Node *) tree->nodes.data[i])->boundingSphere;
-	x += bs->x;
-	y += bs->y;
-	z += bs->z;
+    int n = tree->nodes.size, c = tree->nodes.capacity;
+    float *xs = tree->spheres, *ys = xs + c, *zs = ys + c;
+    for (i = 0; i < n; i++){
+	x += xs[i];
+	y += ys[i];
+	z += zs[i];
     }
     x /= i; y /= i; z /= i;
     Point p = {x, y, z};
@@ -315,41 +528,70 @@ static void setSplitDirection(AABBtree *tree){
 }
 
 static void deleteTree(AABBtree *tree){
+    int i;
+    for (i = 0; i < nChildren(tree); i++)
+        deleteTree(tree->children[i]);
+    if (tree->children != tree->childrenData) free(tree->children);
     hpsDeleteVector(&tree->nodes);
+    if (tree->spheres != tree->spheresData) free(tree->spheres);
     hpsDeleteFrom(tree, tree->pool);
 }
 
+/* Cells, and the heap storage of those whose nodes or children have outgrown them */
+size_t hpsAABBmemoryUse(void *partition, size_t *cellBytes, size_t *heapBytes){
+    AABBtree *tree = partition;
+    size_t cells = 1;
+    int i, n = nChildren(tree);
+    *cellBytes += sizeof(AABBtree);
+    if (!tree->nodes.isStatic)
+        *heapBytes += tree->nodes.capacity * sizeof(void *);
+    if (tree->spheres != tree->spheresData)
+        *heapBytes += 4 * tree->nodes.capacity * sizeof(float);
+    if (tree->children != tree->childrenData)
+        *heapBytes += 27 * sizeof(AABBtree *);
+    for (i = 0; i < n; i++)
+        cells += hpsAABBmemoryUse(tree->children[i], cellBytes, heapBytes);
+    return cells;
+}
+
 static void updateExtents(AABBtree *tree){
     HPSvector *nodes = &tree->nodes;
     int nCurrentNodes = nodes->size;
     Point max = {-INFINITY, -INFINITY, -INFINITY};
     Point min = {INFINITY, INFINITY, INFINITY};
+    float maxDistance = -INFINITY, nearestMaxDistance = INFINITY;
+    int c = nodes->capacity;
+    float *xs = tree->spheres, *ys = xs + c, *zs = ys + c, *rs = zs + c;
     int i;
+    for (i = 0; i < nCurrentNodes; i++){
+	max.x = fmaxf(max.x, xs[i] + rs[i]);
+	max.y = fmaxf(max.y, ys[i] + rs[i]);
+	max.z = fmaxf(max.z, zs[i] + rs[i]);
+	min.x = fminf(min.x, xs[i] - rs[i]);
+	min.y = fminf(min.y, ys[i] - rs[i]);
+	min.z = fminf(min.z, zs[i] - rs[i]);
+    }
     for (i = 0; i < nCurrentNodes; i++){
 	Node *node = nodes->data[i];
-	BoundingSphere *bs = node->boundingSphere;
-	max.x = fmax(max.x, bs->x + bs->r);
-	max.y = fmax(max.y, bs->y + bs->r);
-	max.z = fmax(max.z, bs->z + bs->r);
-	min.x = fmin(min.x, bs->x - bs->r);
-	min.y = fmin(min.y, bs->y - bs->r);
-	min.z = fmin(min.z, bs->z - bs->r);
-    }
-    for (i = 0; i < 27; i++){
+	maxDistance = fmax(maxDistance, node->maxDistance);
+	nearestMaxDistance = fmin(nearestMaxDistance, node->maxDistance);
+    }
+    for (i = 0; i < nChildren(tree); i++){
 	AABBtree *child = tree->children[i];
-	if (child){
-	    if (!child->extentsCorrect)
-		updateExtents(child);
-	    max.x = fmax(max.x, child->max.x);
-	    max.y = fmax(max.y, child->max.y);
-	    max.z = fmax(max.z, child->max.z);
-	    min.x = fmin(min.x, child->min.x);
-	    min.y = fmin(min.y, child->min.y);
-	    min.z = fmin(min.z, child->min.z);
-	}
+	if (!child->extentsCorrect)
+	    updateExtents(child);
+	max.x = fmax(max.x, child->max.x);
+	max.y = fmax(max.y, child->max.y);
+	max.z = fmax(max.z, child->max.z);
+	min.x = fmin(min.x, child->min.x);
+	min.y = fmin(min.y, child->min.y);
+	min.z = fmin(min.z, child->min.z);
+	maxDistance = fmax(maxDistance, child->maxDistance);
     }
     tree->max = max;
     tree->min = min;
+    tree->maxDistance = maxDistance;
+    tree->nearestMaxDistance = nearestMaxDistance;
     setSplitLocation(tree);
     tree->extentsCorrect = true;
 }
@@ -376,40 +618,80 @@ static void splitTree(AABBtree *tree){
     if (tree->split & SPLIT_Z) printf("z-axis ");
     printf("\n");
 #endif
-    for (i = 0; i < nodes->size;){
-	if (!nodes->data[i]){
-	    hpsRemoveNth(nodes, i);
-	} else {
-	    i++;
-	}
-    }
-    for (i = 0; i < 27; i++){
-	AABBtree *child = tree->children[i];
-	if (child){
-	    if (child->nodes.size == nCurrentNodes)
-		goto abort;
+    int j;
+    for (i = 0, j = 0; i < nodes->size; i++){
+	if (nodes->data[i]){
+            copySphere(tree, i, j);
+            ((Node *) nodes->data[i])->slot = j;
+	    nodes->data[j++] = nodes->data[i];
 	}
     }
-    for (i = 0; i < 27; i++){
-	AABBtree *child = tree->children[i];
-	if (child){
-	    updateExtents(child);
-	}
+    nodes->size = j;
+    for (i = 0; i < nChildren(tree); i++){
+	if (tree->children[i]->nodes.size == nCurrentNodes)
+	    goto abort;
     }
+    fitNodes(tree);
+    for (i = 0; i < nChildren(tree); i++)
+	updateExtents(tree->children[i]);
     return;
 abort:
 #ifdef DEBUG
     printf("Aborting split of tree %p\n", tree);
 #endif
-    for (i = 0; i < 27; i++){
+    for (i = 0; i < nChildren(tree); i++){
 	AABBtree *child = tree->children[i];
-	if (child){
-	    Node *n;
-	    while ((n = hpsPop(&child->nodes))){
-                addNode(n, tree);
-	    }
+	Node *n;
+	while ((n = hpsPop(&child->nodes))){
+            addNode(n, tree);
 	}
+	fitNodes(child);
+    }
+}
+
+/* Maintenance */
+/* Trees with pending work are marked up to the root, so that maintenance only descends into marked trees */
+static void queueMaintenance(AABBtree *tree){
+    AABBtree *t;
+    for (t = tree; t && !t->needsMaintenance; t = t->parent)
+        t->needsMaintenance = true;
+}
+
+/* Trees that have grown too large are only split once culling finds that a view needs them to be, so trees that are only ever wholly in or out of view stay whole. Culling may be run on several views at once, so the marks are stored atomically */
+static void requestSplit(AABBtree *tree){
+    AABBtree *t;
+    if (__atomic_load_n(&tree->needsSplit, __ATOMIC_RELAXED)) return;
+    __atomic_store_n(&tree->needsSplit, true, __ATOMIC_RELAXED);
+    for (t = tree; t && !__atomic_load_n(&t->needsMaintenance, __ATOMIC_RELAXED); t = t->parent)
+        __atomic_store_n(&t->needsMaintenance, true, __ATOMIC_RELAXED);
+}
+
+/* Children are maintained before their parent, so that the parent's extents are recomputed from correct ones. The work done is counted as the number of nodes and children looked at */
+static unsigned int maintainTree(AABBtree *tree, unsigned int budget){
+    unsigned int work = 0;
+    int i;
+    for (i = 0; i < nChildren(tree) && work < budget; i++)
+        if (tree->children[i]->needsMaintenance)
+            work += maintainTree(tree->children[i], budget - work);
+    if (work >= budget) return work;
+    if (!tree->extentsCorrect){
+        work += tree->nodes.size + nChildren(tree);
+        updateExtents(tree);
     }
+    if (tree->needsSplit && !tree->split && tree->nodes.size >= SPLIT_THRESHOLD){
+        work += tree->nodes.size;
+        splitTree(tree);
+    }
+    tree->needsSplit = false;
+    tree->needsMaintenance = false;
+    for (i = 0; i < nChildren(tree); i++)
+        if (tree->children[i]->needsMaintenance)
+            tree->needsMaintenance = true;
+    return work;
+}
+
+unsigned int hpsAABBmaintain(AABBtree *tree, unsigned int budget){
+    return tree->needsMaintenance ? maintainTree(tree, budget) : 0;
 }
 
 /* Visibility testing */
@@ -436,13 +718,15 @@ static void setPNvectors(Plane *plane, Point *p, Point *n, Point *min, Point *ma
     else                { p->z = max->z; n->z = min->z; }
 }
 
-static Intersection inPlanes(AABBtree *t, Plane *planes, int inMask, int *outMask){
-    float a, b; int i, k = 1 << t->lastChecked;
+/* The plane that a tree was last found outside of, for the camera doing the culling, is tested first: it is likely to exclude the tree again. Each camera only writes its own hint, so different cameras can be culled at the same time, apart from those past the 31st, which share one */
+static Intersection inPlanes(AABBtree *t, Plane *planes, unsigned int camera,
+                             int inMask, int *outMask){
+    unsigned char *lastChecked = &t->planeHints[camera];
+    float a, b; int i, k = 1 << *lastChecked;
     Point p, n;
     Intersection result = INSIDE;
-    Plane plane = planes[t->lastChecked];
-    Point min, max;
-    getAABBtreeExtents(t, &min, &max);
+    Plane plane = planes[*lastChecked];
+    Point min = t->min, max = t->max;
     if (k & inMask) {
         setPNvectors(&plane, &p, &n, &min, &max);
         a = (plane.a * p.x) + (plane.b * p.y) + (plane.c * p.z) + plane.d;
@@ -451,11 +735,11 @@ static Intersection inPlanes(AABBtree *t, Plane *planes, int inMask, int *outMas
         if (b < 0) { *outMask |= k; result = INTERSECT; }
     }
     for (i = 0, k = 1; k <= inMask; i++, k += k){
-        if ((i != t->lastChecked) && (k & inMask)){
+        if ((i != *lastChecked) && (k & inMask)){
             plane = planes[i];
             setPNvectors(&plane, &p, &n, &min, &max);
             a = (plane.a * p.x) + (plane.b * p.y) + (plane.c * p.z) + plane.d;
-            if (a < 0) { t->lastChecked = i; return OUTSIDE; }
+            if (a < 0) { *lastChecked = i; return OUTSIDE; }
             b = (plane.a * n.x) + (plane.b * n.y) + (plane.c * n.z) + plane.d;
             if (b < 0) { *outMask |= k; result = INTERSECT; }
         }
@@ -463,46 +747,105 @@ static Intersection inPlanes(AABBtree *t, Plane *planes, int inMask, int *outMas
     return result;
 }
 
-static void treeMap(AABBtree *tree, void (*func)(Node *)){
+/* Distance and size culling. Every node's sphere is inside its tree's extents, so no node is closer to the camera than the tree, or larger than half of the tree's diagonal */
+static bool treeCulled(AABBtree *t, View *view){
+    float sx = t->max.x - t->min.x, sy = t->max.y - t->min.y, sz = t->max.z - t->min.z;
+    float r = sqrtf(sx*sx + sy*sy + sz*sz) * 0.5;
+    return !hpsBoxInRange(view, &t->min.x, &t->max.x, r, t->maxDistance);
+}
+
+static void mapNodes(AABBtree *tree, View *view, void (*func)(Node *)){
+    Node **nodes = (Node **) tree->nodes.data;
+    int n = tree->nodes.size, c = tree->nodes.capacity;
+    float *xs = tree->spheres, *ys = xs + c, *zs = ys + c, *rs = zs + c;
+    int i;
+    if (view->minSize > 0 || tree->nearestMaxDistance < INFINITY){
+        for (i = 0; i < n; i++)
+            if (hpsSphereInRange(view, xs[i], ys[i], zs[i], rs[i], nodes[i]->maxDistance))
+                func(nodes[i]);
+    } else {
+        for (i = 0; i < n; i++)
+            func(nodes[i]);
+    }
+}
+
+/* Nodes of a tree that crosses the planes in planeMask are tested against those planes. The tests are done on batches of spheres, in a form the compiler can vectorize */
+static void mapIntersectingNodes(AABBtree *tree, View *view, void (*func)(Node *),
+                                 int planeMask){
+    Node **nodes = (Node **) tree->nodes.data;
+    int n = tree->nodes.size, c = tree->nodes.capacity;
+    float *xs = tree->spheres, *ys = xs + c, *zs = ys + c, *rs = zs + c;
+    bool limited = view->minSize > 0 || tree->nearestMaxDistance < INFINITY;
+    int i, j, k;
+    for (i = 0; i < n; i += SPHERE_BATCH){
+        float x[SPHERE_BATCH], y[SPHERE_BATCH], z[SPHERE_BATCH], r[SPHERE_BATCH];
+        int inside[SPHERE_BATCH];
+        int m = (n - i < SPHERE_BATCH) ? n - i : SPHERE_BATCH;
+        for (j = 0; j < SPHERE_BATCH; j++){
+            // A partial batch is padded out with its last sphere
+            int l = i + ((j < m) ? j : m - 1);
+            x[j] = xs[l]; y[j] = ys[l]; z[j] = zs[l]; r[j] = rs[l];
+            inside[j] = 1;
+        }
+        for (k = 0; k < 6; k++){
+            if (!(planeMask & (1 << k))) continue;
+            Plane p = view->planes[k];
+            for (j = 0; j < SPHERE_BATCH; j++)
+                inside[j] &= (p.a * x[j] + p.b * y[j] + p.c * z[j] + p.d >= -r[j]);
+        }
+        for (j = 0; j < m; j++)
+            if (inside[j] &&
+                (!limited ||
+                 hpsSphereInRange(view, x[j], y[j], z[j], r[j], nodes[i + j]->maxDistance)))
+                func(nodes[i + j]);
+    }
+}
+
+static void treeMap(AABBtree *tree, View *view, void (*func)(Node *)){
 #ifdef DEBUG
     nTrees++;
 #endif 
-    int i;
-    for (i = 0; i < tree->nodes.size; i++)
-	func(tree->nodes.data[i]);
-    for (i = 0; i < 27; i++){
+    int i, n = nChildren(tree);
+    mapNodes(tree, view, func);
+    for (i = 0; i < n; i++){
 	AABBtree *child = tree->children[i];
-	if (child)
-	    treeMap(child, func);
+	if (!treeCulled(child, view))
+	    treeMap(child, view, func);
     }
 }
 
-static void doVisible(AABBtree *tree, Plane *planes, void (*func)(Node *), int planeMask){
+static void doVisible(AABBtree *tree, View *view, void (*func)(Node *),
+                      unsigned int camera, int planeMask){
     int nextMask = 0;
-    int inView = inPlanes(tree, planes, planeMask, &nextMask);
-    int i;
+    int inView;
+    int i, n;
+    if (!tree->split && tree->nodes.size >= SPLIT_THRESHOLD)
+        requestSplit(tree);
+    inView = inPlanes(tree, view->planes, camera, planeMask, &nextMask);
+    if (inView == OUTSIDE || treeCulled(tree, view))
+        return;
     if (inView == INSIDE)
-	treeMap(tree, func);
-    else if (inView == INTERSECT){
+	treeMap(tree, view, func);
+    else {
 #ifdef DEBUG
         nTrees++;
 #endif 
-	for (i = 0; i < tree->nodes.size; i++)
-	    func(tree->nodes.data[i]);
-	for (i = 0; i < 27; i++){
-	    AABBtree *child = tree->children[i];
-	    if (child)
-		doVisible(child, planes, func, nextMask);
-	}
+	mapIntersectingNodes(tree, view, func, nextMask);
+	for (i = 0, n = nChildren(tree); i < n; i++)
+	    doVisible(tree->children[i], view, func, camera, nextMask);
     }
 }
 
-void hpsAABBdoVisible(AABBtree *tree, Plane *planes, void (*func)(Node *)){
+static unsigned int hintIndex(View *view){
+    return (view->camera < MAX_CAMERAS) ? view->camera : MAX_CAMERAS - 1;
+}
+
+void hpsAABBdoVisible(AABBtree *tree, View *view, void (*func)(Node *)){
 #ifdef DEBUG
     int oldNTrees = nTrees;
     nTrees = 0;
 #endif 
-    doVisible(tree, planes, func, ALL_PLANES);
+    doVisible(tree, view, func, hintIndex(view), ALL_PLANES);
 #ifdef DEBUG
     if ((nTrees != oldNTrees)){
         printf("%d trees were visible\n", nTrees);
@@ -512,3 +855,117 @@ void hpsAABBdoVisible(AABBtree *tree, Plane *planes, void (*func)(Node *)){
     }
 #endif 
 }
+
+/* Culling several views at once
+   The tree is walked once for all of the views. Each view is a bit in two masks: active views cross the planes of the tree's parent, and test the tree against the planes in their plane mask, while inside views hold the whole tree, and only test distance and size */
+typedef struct {
+    View *views;
+    unsigned int cameras[MAX_CAMERAS]; // Indices of the views' plane hints
+    void (*func)(Node *, unsigned int);
+} ViewsCull;
+
+/* Views that hold the whole tree, and can't leave any of its nodes out for their distance or size, see every node without testing them */
+static void mapNodesViews(AABBtree *tree, ViewsCull *cull, unsigned int active,
+                          unsigned int inside, int *planeMasks){
+    Node **nodes = (Node **) tree->nodes.data;
+    int n = tree->nodes.size, c = tree->nodes.capacity;
+    float *xs = tree->spheres, *ys = xs + c, *zs = ys + c, *rs = zs + c;
+    unsigned int all = 0, tested = active, views;
+    int i, j, k;
+    for (views = inside; views; views &= views - 1){
+        int v = __builtin_ctz(views);
+        if (cull->views[v].minSize > 0 || tree->nearestMaxDistance < INFINITY)
+            tested |= 1u << v;
+        else
+            all |= 1u << v;
+    }
+    if (!tested){
+        for (i = 0; i < n; i++)
+            cull->func(nodes[i], all);
+        return;
+    }
+    for (i = 0; i < n; i += SPHERE_BATCH){
+        float x[SPHERE_BATCH], y[SPHERE_BATCH], z[SPHERE_BATCH], r[SPHERE_BATCH];
+        unsigned int visible[SPHERE_BATCH];
+        int m = (n - i < SPHERE_BATCH) ? n - i : SPHERE_BATCH;
+        for (j = 0; j < SPHERE_BATCH; j++){
+            int l = i + ((j < m) ? j : m - 1);
+            x[j] = xs[l]; y[j] = ys[l]; z[j] = zs[l]; r[j] = rs[l];
+            visible[j] = all;
+        }
+        for (views = tested; views; views &= views - 1){
+            int v = __builtin_ctz(views);
+            unsigned int bit = 1u << v;
+            View *view = &cull->views[v];
+            bool limited = view->minSize > 0 || tree->nearestMaxDistance < INFINITY;
+            int in[SPHERE_BATCH];
+            for (j = 0; j < SPHERE_BATCH; j++)
+                in[j] = 1;
+            if (active & bit)
+                for (k = 0; k < 6; k++){
+                    if (!(planeMasks[v] & (1 << k))) continue;
+                    Plane p = view->planes[k];
+                    for (j = 0; j < SPHERE_BATCH; j++)
+                        in[j] &= (p.a * x[j] + p.b * y[j] + p.c * z[j] + p.d >= -r[j]);
+                }
+            for (j = 0; j < m; j++)
+                if (in[j] &&
+                    (!limited ||
+                     hpsSphereInRange(view, x[j], y[j], z[j], r[j], nodes[i + j]->maxDistance)))
+                    visible[j] |= bit;
+        }
+        for (j = 0; j < m; j++)
+            if (visible[j])
+                cull->func(nodes[i + j], visible[j]);
+    }
+}
+
+static void doVisibleViews(AABBtree *tree, ViewsCull *cull, unsigned int active,
+                           unsigned int inside, int *planeMasks){
+    int nextMasks[MAX_CAMERAS];
+    unsigned int views, nextActive = 0;
+    int i, n;
+    if (!tree->split && tree->nodes.size >= SPLIT_THRESHOLD)
+        requestSplit(tree);
+    for (views = active; views; views &= views - 1){
+        int v = __builtin_ctz(views);
+        nextMasks[v] = 0;
+        switch (inPlanes(tree, cull->views[v].planes, cull->cameras[v], planeMasks[v],
+                         &nextMasks[v])){
+        case INTERSECT: nextActive |= 1u << v; break;
+        case INSIDE: inside |= 1u << v; break;
+        case OUTSIDE: break;
+        }
+    }
+    for (views = nextActive | inside; views; views &= views - 1){
+        int v = __builtin_ctz(views);
+        if (treeCulled(tree, &cull->views[v])){
+            nextActive &= ~(1u << v);
+            inside &= ~(1u << v);
+        }
+    }
+    if (!(nextActive | inside))
+        return;
+    mapNodesViews(tree, cull, nextActive, inside, nextMasks);
+    for (i = 0, n = nChildren(tree); i < n; i++)
+        doVisibleViews(tree->children[i], cull, nextActive, inside, nextMasks);
+}
+
+void hpsAABBdoVisibleViews(AABBtree *tree, View *views, unsigned int n,
+                           void (*func)(Node *, unsigned int)){
+    ViewsCull cull;
+    int planeMasks[MAX_CAMERAS];
+    unsigned int i;
+    if (n > MAX_CAMERAS){
+        fprintf(stderr, "At most %d views can be culled at once\n", MAX_CAMERAS);
+        return;
+    }
+    if (!n) return;
+    cull.views = views;
+    cull.func = func;
+    for (i = 0; i < n; i++){
+        cull.cameras[i] = hintIndex(&views[i]);
+        planeMasks[i] = ALL_PLANES;
+    }
+    doVisibleViews(tree, &cull, (n == MAX_CAMERAS) ? ~0u : (1u << n) - 1, 0, planeMasks);
+}
@@ -0,0 +1,509 @@
+// Bounding volume hierarchy built with a binned surface area heuristic, based off of:
+// Ingo Wald, "On fast Construction of SAH-based Bounding Volume Hierarchies" (2007)
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "partition.h"
+#include "memory.h"
+
+/*
+  A binary tree of volumes, whose leaves hold the nodes. Subtrees are built top-down, splitting the nodes where the surface area heuristic (the sum of each side's surface area times its number of nodes) is lowest, found by sorting the nodes' centres into bins along each axis. Nodes that are added or moved grow their leaf and its ancestors to fit them, and update the leaf's copy of their bounding sphere, so bounds are always large enough and culling never has to change the BVH. Nodes that are removed leave their leaf's bounds as they are. Changed leaves are also marked: when the BVH is maintained they are refit, shrinking them back to their nodes, and their bounds are propagated up the tree. Any subtree whose surface area has grown past REBUILD_GROWTH times what it was when it was built is then marked to be rebuilt, as are leaves that have grown too large, and the parents of leaves that are empty. Rebuilds are only done when the BVH is maintained.
+ */
+
+#define LEAF_NODES 8 // Nodes held in the volume itself, more are stored on the heap
+#define MAX_LEAF_NODES 16
+#define BINS 16
+#define TRAVERSAL_COST 8 // Relative to testing a node
+#define REBUILD_GROWTH 2
+#define ALL_PLANES 63 // bx111111
+
+typedef struct bvh BVH;
+
+typedef struct volume {
+    struct volume *parent;
+    struct volume *children[2]; // NULL for leaves
+    BVH *bvh;
+    float min[3], max[3];
+    float maxDistance; // Greatest maxDistance of the nodes in the volume
+    float maxRadius; // Largest node in the volume
+    float nearestMaxDistance; // Smallest maxDistance of the nodes in the volume
+    float builtArea;
+    bool dirty, needsRebuild;
+    HPSvector nodes;
+    BoundingSphere *spheres; // Copies of the nodes' bounding spheres, in the same order as the nodes
+    unsigned int sphereCapacity;
+    Node *nodesData[LEAF_NODES];
+    BoundingSphere spheresData[LEAF_NODES];
+} Volume;
+
+struct bvh {
+    HPSpool pool;
+    Volume *root;
+    HPSvector dirty, rebuilds;
+};
+
+typedef struct {
+    float min[3], max[3];
+    int count;
+} Bin;
+
+BVH *hpsBVHnew();
+void hpsBVHdelete(BVH *bvh);
+void hpsBVHaddNode(Node *node, BVH *bvh);
+void hpsBVHaddNodes(Node **nodes, size_t n, BVH *bvh);
+void hpsBVHremoveNode(Node *node);
+void hpsBVHupdateNode(Node *node);
+void hpsBVHdoVisible(BVH *bvh, View *view, void (*func)(Node *));
+unsigned int hpsBVHmaintain(BVH *bvh, unsigned int budget);
+
+unsigned int hpsBVHpartitionPoolSize = 4096;
+
+static HPSvector buildNodes; // Nodes of the subtree being built
+
+static PartitionInterface bvhInterface =
+    {(void *(*)()) hpsBVHnew,
+     (void (*)(void *)) hpsBVHdelete,
+     (void (*)(Node *, void *)) hpsBVHaddNode,
+     (void (*)(Node **, size_t, void *)) hpsBVHaddNodes,
+     (void (*)(Node *)) hpsBVHremoveNode,
+     NULL,
+     (void (*)(Node *)) hpsBVHupdateNode,
+     (void (*)(void *, View *, void (*)(Node *))) hpsBVHdoVisible,
+     (unsigned int (*)(void *, unsigned int)) hpsBVHmaintain,
+     NULL};
+
+PartitionInterface *hpsBVHpartitionInterface = &bvhInterface;
+
+/* Bounds */
+static void emptyBounds(float *min, float *max){
+    int j;
+    for (j = 0; j < 3; j++){
+        min[j] = INFINITY;
+        max[j] = -INFINITY;
+    }
+}
+
+static void growBounds(float *min, float *max, BoundingSphere *bs){
+    float *c = (float *) bs;
+    int j;
+    for (j = 0; j < 3; j++){
+        min[j] = fminf(min[j], c[j] - bs->r);
+        max[j] = fmaxf(max[j], c[j] + bs->r);
+    }
+}
+
+static void mergeBounds(float *min, float *max, float *otherMin, float *otherMax){
+    int j;
+    for (j = 0; j < 3; j++){
+        min[j] = fminf(min[j], otherMin[j]);
+        max[j] = fmaxf(max[j], otherMax[j]);
+    }
+}
+
+/* Half of the surface area, which is all that the heuristic needs */
+static float area(float *min, float *max){
+    float x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+    if (x < 0) return 0;
+    return x*y + y*z + z*x;
+}
+
+/* Volumes */
+static Volume *newVolume(BVH *bvh, Volume *parent){
+    Volume *v = hpsAllocateFrom(bvh->pool);
+    v->parent = parent;
+    v->children[0] = v->children[1] = NULL;
+    v->bvh = bvh;
+    emptyBounds(v->min, v->max);
+    v->maxDistance = -INFINITY;
+    v->maxRadius = 0;
+    v->nearestMaxDistance = INFINITY;
+    v->builtArea = 0;
+    v->dirty = false;
+    v->needsRebuild = false;
+    hpsInitStaticVector(&v->nodes, v->nodesData, LEAF_NODES);
+    v->spheres = v->spheresData;
+    v->sphereCapacity = LEAF_NODES;
+    return v;
+}
+
+static void deleteLeaf(Volume *v){
+    hpsDeleteVector(&v->nodes);
+    if (v->spheres != v->spheresData) free(v->spheres);
+    hpsInitStaticVector(&v->nodes, v->nodesData, LEAF_NODES);
+    v->spheres = v->spheresData;
+    v->sphereCapacity = LEAF_NODES;
+}
+
+/* Keeps room for a sphere for each of the leaf's nodes, keeping the spheres already copied */
+static void reserveSpheres(Volume *v){
+    BoundingSphere *spheres;
+    if (v->nodes.capacity <= v->sphereCapacity) return;
+    spheres = malloc(v->nodes.capacity * sizeof(BoundingSphere));
+    memcpy(spheres, v->spheres, v->sphereCapacity * sizeof(BoundingSphere));
+    if (v->spheres != v->spheresData) free(v->spheres);
+    v->spheres = spheres;
+    v->sphereCapacity = v->nodes.capacity;
+}
+
+static void fitLeaf(Volume *v){
+    Node **nodes = (Node **) v->nodes.data;
+    int i;
+    reserveSpheres(v);
+    emptyBounds(v->min, v->max);
+    v->maxDistance = -INFINITY;
+    v->maxRadius = 0;
+    v->nearestMaxDistance = INFINITY;
+    for (i = 0; i < v->nodes.size; i++){
+        v->spheres[i] = *nodes[i]->boundingSphere;
+        growBounds(v->min, v->max, nodes[i]->boundingSphere);
+        v->maxDistance = fmaxf(v->maxDistance, nodes[i]->maxDistance);
+        v->maxRadius = fmaxf(v->maxRadius, nodes[i]->boundingSphere->r);
+        v->nearestMaxDistance = fminf(v->nearestMaxDistance, nodes[i]->maxDistance);
+    }
+}
+
+/* Grows v and its ancestors until one already holds the node */
+static void growToFit(Volume *v, Node *node){
+    BoundingSphere *bs = node->boundingSphere;
+    float old[9];
+    for (; v; v = v->parent){
+        memcpy(old, v->min, sizeof(old));
+        growBounds(v->min, v->max, bs);
+        v->maxDistance = fmaxf(v->maxDistance, node->maxDistance);
+        v->maxRadius = fmaxf(v->maxRadius, bs->r);
+        v->nearestMaxDistance = fminf(v->nearestMaxDistance, node->maxDistance);
+        if (!memcmp(old, v->min, sizeof(old))) break;
+    }
+}
+
+static void fitBranch(Volume *v){
+    Volume *a = v->children[0], *b = v->children[1];
+    memcpy(v->min, a->min, sizeof(float) * 3);
+    memcpy(v->max, a->max, sizeof(float) * 3);
+    mergeBounds(v->min, v->max, b->min, b->max);
+    v->maxDistance = fmaxf(a->maxDistance, b->maxDistance);
+    v->maxRadius = fmaxf(a->maxRadius, b->maxRadius);
+    v->nearestMaxDistance = fminf(a->nearestMaxDistance, b->nearestMaxDistance);
+}
+
+/* Building */
+static int binIndex(float c, float min, float scale){
+    int i = (c - min) * scale;
+    return (i < BINS) ? i : BINS - 1;
+}
+
+/* Sorts the nodes into the two sides of the cheapest split, returning the number on the first side, or 0 if they are cheaper left as a leaf */
+static int split(Node **nodes, int n){
+    float cmin[3], cmax[3], min[3], max[3];
+    float bestCost = INFINITY, bestScale = 0;
+    int bestAxis = -1, bestBin = 0;
+    int axis, i, j;
+    emptyBounds(cmin, cmax);
+    emptyBounds(min, max);
+    for (i = 0; i < n; i++){
+        BoundingSphere *bs = nodes[i]->boundingSphere;
+        BoundingSphere centre = {bs->x, bs->y, bs->z, 0};
+        growBounds(cmin, cmax, &centre);
+        growBounds(min, max, bs);
+    }
+    for (axis = 0; axis < 3; axis++){
+        Bin bins[BINS];
+        float rightArea[BINS];
+        int rightCount[BINS];
+        float extent = cmax[axis] - cmin[axis];
+        float scale, lmin[3], lmax[3];
+        int leftCount = 0;
+        if (!(extent > 0)) continue;
+        scale = BINS / extent;
+        for (j = 0; j < BINS; j++){
+            emptyBounds(bins[j].min, bins[j].max);
+            bins[j].count = 0;
+        }
+        for (i = 0; i < n; i++){
+            BoundingSphere *bs = nodes[i]->boundingSphere;
+            Bin *b = &bins[binIndex(((float *) bs)[axis], cmin[axis], scale)];
+            growBounds(b->min, b->max, bs);
+            b->count++;
+        }
+        emptyBounds(lmin, lmax);
+        for (j = BINS - 1; j > 0; j--){
+            mergeBounds(lmin, lmax, bins[j].min, bins[j].max);
+            rightArea[j] = area(lmin, lmax);
+            rightCount[j] = bins[j].count + ((j < BINS - 1) ? rightCount[j + 1] : 0);
+        }
+        emptyBounds(lmin, lmax);
+        for (j = 1; j < BINS; j++){
+            mergeBounds(lmin, lmax, bins[j - 1].min, bins[j - 1].max);
+            leftCount += bins[j - 1].count;
+            if (!leftCount || !rightCount[j]) continue;
+            float cost = area(lmin, lmax) * leftCount + rightArea[j] * rightCount[j];
+            if (cost < bestCost){
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = j;
+                bestScale = scale;
+            }
+        }
+    }
+    if (bestAxis < 0) // Every centre is the same
+        return (n > MAX_LEAF_NODES) ? n / 2 : 0;
+    if (n <= MAX_LEAF_NODES && area(min, max) * n <= bestCost + TRAVERSAL_COST * area(min, max))
+        return 0;
+    for (i = 0, j = n - 1; i <= j;){
+        float c = ((float *) nodes[i]->boundingSphere)[bestAxis];
+        if (binIndex(c, cmin[bestAxis], bestScale) < bestBin){
+            i++;
+        } else {
+            Node *swap = nodes[i];
+            nodes[i] = nodes[j];
+            nodes[j--] = swap;
+        }
+    }
+    return i;
+}
+
+static void build(BVH *bvh, Volume *v, Node **nodes, int n){
+    int i, left = (n > 1) ? split(nodes, n) : 0;
+    v->dirty = false;
+    v->needsRebuild = false;
+    if (left){
+        v->children[0] = newVolume(bvh, v);
+        v->children[1] = newVolume(bvh, v);
+        build(bvh, v->children[0], nodes, left);
+        build(bvh, v->children[1], nodes + left, n - left);
+        fitBranch(v);
+    } else {
+        v->children[0] = v->children[1] = NULL;
+        for (i = 0; i < n; i++){
+            hpsPush(&v->nodes, nodes[i]);
+            nodes[i]->area = v;
+            nodes[i]->slot = i;
+        }
+        fitLeaf(v);
+    }
+    v->builtArea = area(v->min, v->max);
+}
+
+/* Adds the nodes below v to buildNodes, deleting everything below v */
+static void collect(Volume *v){
+    int i;
+    if (v->children[0]){
+        for (i = 0; i < 2; i++){
+            collect(v->children[i]);
+            hpsDeleteFrom(v->children[i], v->bvh->pool);
+        }
+    } else {
+        for (i = 0; i < v->nodes.size; i++)
+            hpsPush(&buildNodes, v->nodes.data[i]);
+        deleteLeaf(v);
+    }
+}
+
+/* Returns the number of nodes rebuilt */
+static unsigned int rebuild(Volume *v){
+    unsigned int n;
+    buildNodes.size = 0;
+    collect(v);
+    n = buildNodes.size;
+    build(v->bvh, v, (Node **) buildNodes.data, n);
+    return n;
+}
+
+/* Maintenance */
+static void markDirty(Volume *v){
+    if (!v->dirty){
+        v->dirty = true;
+        hpsPush(&v->bvh->dirty, v);
+    }
+}
+
+static void markRebuild(Volume *v){
+    if (!v->needsRebuild){
+        v->needsRebuild = true;
+        hpsPush(&v->bvh->rebuilds, v);
+    }
+}
+
+/* Volumes are refit up from the leaf for as long as their bounds change */
+static void refit(Volume *leaf){
+    Volume *v = leaf;
+    float old[9];
+    fitLeaf(leaf);
+    leaf->dirty = false;
+    if (leaf->nodes.size > MAX_LEAF_NODES)
+        markRebuild(leaf);
+    else if (!leaf->nodes.size && leaf->parent)
+        markRebuild(leaf->parent);
+    while ((v = v->parent)){
+        memcpy(old, v->min, sizeof(old));
+        fitBranch(v);
+        if (!memcmp(old, v->min, sizeof(old))) break;
+        if (area(v->min, v->max) > REBUILD_GROWTH * v->builtArea)
+            markRebuild(v);
+    }
+}
+
+/* Returns the number of nodes in the leaves that were refit */
+static unsigned int refitDirty(BVH *bvh){
+    unsigned int work = 0;
+    int i;
+    for (i = 0; i < bvh->dirty.size; i++){
+        Volume *v = bvh->dirty.data[i];
+        work += v->nodes.size;
+        refit(v);
+    }
+    bvh->dirty.size = 0;
+    return work;
+}
+
+/* Refits are always done, since they are cheap and tighten the bounds that culling is tested against. Only the highest of the volumes that need to be rebuilt are, since those below them are rebuilt along with them, and those left over once the budget is spent wait for the next call */
+unsigned int hpsBVHmaintain(BVH *bvh, unsigned int budget){
+    HPSvector *rebuilds = &bvh->rebuilds;
+    unsigned int work = refitDirty(bvh);
+    int i, j;
+    for (i = 0, j = 0; i < rebuilds->size; i++){
+        Volume *v = rebuilds->data[i], *a;
+        for (a = v->parent; a && !a->needsRebuild; a = a->parent);
+        if (!a) rebuilds->data[j++] = v;
+    }
+    for (i = 0; i < j && work < budget; i++)
+        work += rebuild(rebuilds->data[i]);
+    memmove(rebuilds->data, &rebuilds->data[i], (j - i) * sizeof(void *));
+    rebuilds->size = j - i;
+    return work;
+}
+
+/* Interface */
+BVH *hpsBVHnew(){
+    BVH *bvh = malloc(sizeof(BVH));
+    bvh->pool = hpsMakePool(sizeof(Volume), hpsBVHpartitionPoolSize, "BVH pool");
+    hpsInitVector(&bvh->dirty, 16);
+    hpsInitVector(&bvh->rebuilds, 16);
+    bvh->root = newVolume(bvh, NULL);
+    return bvh;
+}
+
+static void deleteVolume(Volume *v){
+    if (v->children[0]){
+        deleteVolume(v->children[0]);
+        deleteVolume(v->children[1]);
+    } else {
+        deleteLeaf(v);
+    }
+}
+
+void hpsBVHdelete(BVH *bvh){
+    deleteVolume(bvh->root);
+    hpsDeletePool(bvh->pool);
+    hpsDeleteVector(&bvh->dirty);
+    hpsDeleteVector(&bvh->rebuilds);
+    free(bvh);
+}
+
+/* Nodes descend towards the child whose surface area grows the least */
+void hpsBVHaddNode(Node *node, BVH *bvh){
+    Volume *v = bvh->root;
+    while (v->children[0]){
+        float cost[2];
+        int i;
+        for (i = 0; i < 2; i++){
+            Volume *c = v->children[i];
+            float min[3], max[3];
+            memcpy(min, c->min, sizeof(min));
+            memcpy(max, c->max, sizeof(max));
+            growBounds(min, max, node->boundingSphere);
+            cost[i] = area(min, max) - area(c->min, c->max);
+        }
+        v = v->children[cost[1] < cost[0]];
+    }
+    node->area = v;
+    node->slot = v->nodes.size;
+    hpsPush(&v->nodes, node);
+    reserveSpheres(v);
+    v->spheres[node->slot] = *node->boundingSphere;
+    growToFit(v, node);
+    markDirty(v);
+}
+
+/* An empty hierarchy is built from the whole batch at once */
+void hpsBVHaddNodes(Node **nodes, size_t n, BVH *bvh){
+    Volume *root = bvh->root;
+    size_t i;
+    if (root->children[0] || root->nodes.size){
+        for (i = 0; i < n; i++)
+            hpsBVHaddNode(nodes[i], bvh);
+        return;
+    }
+    buildNodes.size = 0;
+    for (i = 0; i < n; i++)
+        hpsPush(&buildNodes, nodes[i]);
+    deleteLeaf(root);
+    build(bvh, root, (Node **) buildNodes.data, buildNodes.size);
+}
+
+/* The last node of the leaf takes the removed node's slot */
+void hpsBVHremoveNode(Node *node){
+    Volume *v = node->area;
+    HPSvector *nodes = &v->nodes;
+    unsigned int i = node->slot;
+    Node *last;
+    if (i >= nodes->size || nodes->data[i] != node){
+        fprintf(stderr, "Warning, tried to remove node %p from a BVH volume that it did not belong to\n", node->data);
+        return;
+    }
+    last = nodes->data[--nodes->size];
+    nodes->data[i] = last;
+    v->spheres[i] = v->spheres[nodes->size];
+    last->slot = i;
+    markDirty(v);
+}
+
+void hpsBVHupdateNode(Node *node){
+    Volume *v = node->area;
+    v->spheres[node->slot] = *node->boundingSphere;
+    growToFit(v, node);
+    markDirty(v);
+}
+
+/* Visibility testing */
+static void mapVolume(Volume *v, void (*func)(Node *)){
+    int i;
+    if (v->children[0]){
+        mapVolume(v->children[0], func);
+        mapVolume(v->children[1], func);
+        return;
+    }
+    for (i = 0; i < v->nodes.size; i++)
+        func(v->nodes.data[i]);
+}
+
+static void doVisible(Volume *v, View *view, void (*func)(Node *), int planeMask){
+    int nextMask = 0;
+    int i;
+    if (v->min[0] > v->max[0] ||
+        !hpsBoxInRange(view, v->min, v->max, v->maxRadius, v->maxDistance) ||
+        hpsBoxInPlanes(view, v->min, v->max, planeMask, &nextMask) < 0)
+        return;
+    if (!nextMask && view->minSize <= 0 && v->nearestMaxDistance == INFINITY){
+        mapVolume(v, func);
+        return;
+    }
+    if (v->children[0]){
+        doVisible(v->children[0], view, func, nextMask);
+        doVisible(v->children[1], view, func, nextMask);
+        return;
+    }
+    for (i = 0; i < v->nodes.size; i++){
+        BoundingSphere *bs = &v->spheres[i];
+        if (hpsSphereInPlanes(view, bs->x, bs->y, bs->z, bs->r, nextMask) &&
+            hpsSphereInRange(view, bs->x, bs->y, bs->z, bs->r,
+                             ((Node *) v->nodes.data[i])->maxDistance))
+            func(v->nodes.data[i]);
+    }
+}
+
+void hpsBVHdoVisible(BVH *bvh, View *view, void (*func)(Node *)){
+    doVisible(bvh->root, view, func, ALL_PLANES);
+}
@@ -1,19 +1,37 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <math.h>
 #include <float.h>
 #include "scene.h"
 #define HALF_PI 1.57079631
+#define LOD_HYSTERESIS 0.1 // Fraction a level's size must be passed by before it is changed to
+#define MAX_VIEWS 32 // Cameras culled in one walk of a partition
 
 typedef enum {
     RIGHT, LEFT, TOP, BOTTOM, NEAR, FAR
 } Faces;
 
 static HPSvector cameraList, activeCameras, renderQueue, alphaQueue;
+static unsigned int usedCameraMasks;
+static unsigned int lastMaskUsers; // Cameras holding the last mask, which is shared once the others are all used
+static unsigned int renderPass; // Counts calls to hpsRenderCamera
+
+// Stands in for a part of a visible prefab instance until the end of the frame
+typedef struct {
+    HPSnode node;
+    float transform[16];
+    BoundingSphere boundingSphere;
+} PartEntry;
+
+static HPSpool partPool;
 
 static HPScamera currentCamera;
+static HPScamera **cullingCameras; // The cameras being culled by hpsCullCameras
 static float currentInverseTransposeModel[16];
+static float *currentBonePalette;
+static unsigned int currentBoneCount;
 
 HPScamera *hpsCurrentCamera(){ return &currentCamera; }
 
@@ -41,32 +59,159 @@ float *hpsCurrentInverseTransposeModel(){
     return currentInverseTransposeModel;
 }
 
+float *hpsCurrentBonePalette(unsigned int *nBones){
+    *nBones = currentBoneCount;
+    return currentBonePalette;
+}
+
+static void queueNode(HPSnode *n){
+    if (n->pipeline->isAlpha){
+        hpsPush(&alphaQueue, n);
+    } else {
+        hpsPush(&renderQueue, n);
+    }
+}
+
+/* A node that lasts until the end of the frame, for things that are rendered without a node of their own */
+static PartEntry *newStandIn(void *data, HPSpipeline *pipeline){
+    PartEntry *entry = hpsAllocateFrom(partPool);
+    HPSnode *n = &entry->node;
+    n->transform = entry->transform;
+    n->partitionData.boundingSphere = &entry->boundingSphere;
+    n->data = data;
+    n->pipeline = pipeline;
+    n->constraint = HPS_CONSTRAINT_NONE;
+    n->isSkeleton = false;
+    return entry;
+}
+
+static void addPrefabParts(HPSnode *instance){
+    HPSprefab *prefab = instance->cold->prefab;
+    PrefabOverride *overrides = instance->cold->prefabOverrides;
+    int i, nOverrides = instance->cold->nPrefabOverrides;
+    for (i = 0; i < prefab->nParts; i++){
+        PrefabPart *part = &prefab->parts[i];
+        void *data = part->data;
+        HPSpipeline *pipeline = part->pipeline;
+        if (i < nOverrides){
+            data = overrides[i].data;
+            pipeline = overrides[i].pipeline;
+        }
+        if (!pipeline) continue;
+        PartEntry *entry = newStandIn(data, pipeline);
+        hpmMultMat4(part->transform, instance->transform, entry->transform);
+        entry->boundingSphere = part->boundingSphere;
+        hpmMat4VecMult(instance->transform, (float *) &entry->boundingSphere);
+        queueNode(&entry->node);
+    }
+}
+
+/* Diameter of the sphere on screen, as a fraction of the viewport's height */
+static float projectedSize(BoundingSphere *bs){
+    float *projection = currentCamera.projection;
+    if (projection[15] == 1) // Orthographic
+        return bs->r * projection[5];
+    float dx = bs->x - currentCamera.position.x;
+    float dy = bs->y - currentCamera.position.y;
+    float dz = bs->z - currentCamera.position.z;
+    float d = sqrtf(dx*dx + dy*dy + dz*dz);
+    if (d <= bs->r) return INFINITY;
+    return bs->r * projection[5] / d;
+}
+
+/* Decided once per render, the first time the group or one of its members is seen. Only the group's own bounding sphere is measured, which is up to the user to make cover the cluster */
+static bool collapsed(HPSnode *group){
+    HLODGroup *hlod = group->cold->hlod;
+    if (hlod->renderPass != renderPass){
+        hlod->renderPass = renderPass;
+        hlod->collapsed = projectedSize(group->partitionData.boundingSphere) < hlod->threshold;
+        if (hlod->collapsed){
+            PartEntry *entry = newStandIn(hlod->data, hlod->pipeline);
+            memcpy(entry->transform, group->transform, sizeof(float) * 16);
+            entry->boundingSphere = *group->partitionData.boundingSphere;
+            queueNode(&entry->node);
+        }
+    }
+    return hlod->collapsed;
+}
+
+static unsigned int selectLOD(HPSnode *n){
+    NodeLODs *lods = n->cold->lods;
+    float size = projectedSize(n->partitionData.boundingSphere);
+    unsigned int level = n->lodLevel;
+    while (level < lods->nLevels && size < lods->levels[level].size * (1 - LOD_HYSTERESIS))
+        level++;
+    while (level > 0 && size > lods->levels[level - 1].size * (1 + LOD_HYSTERESIS))
+        level--;
+    n->lodLevel = level;
+    return level;
+}
+
+/* The node is copied so that it renders as itself, only with the level's data and pipeline */
+static void queueLOD(HPSnode *n, unsigned int level){
+    LODLevel *lod = &n->cold->lods->levels[level - 1];
+    if (!lod->pipeline) return;
+    PartEntry *entry = hpsAllocateFrom(partPool);
+    entry->node = *n;
+    entry->node.data = lod->data;
+    entry->node.pipeline = lod->pipeline;
+    queueNode(&entry->node);
+}
+
+/* Groups are decided from the root down, stopping at the outermost one that is collapsed, so that groups nested inside it are neither decided nor drawn */
+static bool inCollapsedCluster(HPSnode *n, HPSscene *scene){
+    if ((HPSscene *) n == scene) return false;
+    if (inCollapsedCluster(n->parent, scene)) return true;
+    return n->isHLOD && collapsed(n);
+}
+
 static void addToQueue(Node *node){
     HPSnode *n = (HPSnode *) node->data;
-    if (n->pipeline){
-        if (n->pipeline->isAlpha){
-            hpsPush(&alphaQueue, n);
-        } else {
-            hpsPush(&renderQueue, n);
+    hpsNodeVisible(n, currentCamera.mask);
+    if ((n->isHLOD || n->inCluster) && inCollapsedCluster(n, n->scene)){
+        if (n->hasExtension) hpsVisibleExtensionNode(n);
+        return;
+    }
+    unsigned int level = n->hasLODs ? selectLOD(n) : 0;
+    if (level){
+        queueLOD(n, level);
+    } else {
+        if (n->isPrefab){
+            addPrefabParts(n);
+        }
+        if (n->pipeline){
+            queueNode(n);
         }
     }
-    if (n->extension){
+    if (n->hasExtension){
         hpsVisibleExtensionNode(n);
     }
 }
 
 static void renderNode(HPSnode *node, HPScamera *camera){
-    hpmMultMat4(camera->viewProjection, node->transform, 
+    float *model = node->transform;
+    float billboard[16];
+    if (node->constraint && hpsBillboardTransform(node, camera, billboard))
+        model = billboard;
+    hpmMultMat4(camera->viewProjection, model, 
                 camera->modelViewProjection);
 #ifndef NO_INVERSE_TRANSPOSE
-    hpmFastInverseTranspose(node->transform, currentInverseTransposeModel);
+    hpmFastInverseTranspose(model, currentInverseTransposeModel);
 #endif
+    if (node->isSkeleton){
+        currentBonePalette = node->cold->skeleton->palette;
+        currentBoneCount = node->cold->skeleton->skeleton->nBones;
+    } else {
+        currentBonePalette = NULL;
+        currentBoneCount = 0;
+    }
     node->pipeline->render(node->data);
 }
 
 static void clearQueues(){
     renderQueue.size = 0;
     alphaQueue.size = 0;
+    hpsClearPool(partPool);
 }
 
 static void xPositive(const HPMpoint *a, const HPMpoint *b, float *m, float *n){
@@ -309,6 +454,23 @@ static void computePlanes(HPScamera *camera){
     ps[NEAR].c   = m->_43 + m->_33; ps[NEAR].d   = m->_44 + m->_34;
     ps[FAR].a    = m->_41 - m->_31; ps[FAR].b    = m->_42 - m->_32;
     ps[FAR].c    = m->_43 - m->_33; ps[FAR].d    = m->_44 - m->_34;
+    // Unit normals, so that distances to the planes can be compared with radii
+    int i;
+    for (i = 0; i < 6; i++){
+        float l = sqrtf(ps[i].a * ps[i].a + ps[i].b * ps[i].b + ps[i].c * ps[i].c);
+        ps[i].a /= l; ps[i].b /= l; ps[i].c /= l; ps[i].d /= l;
+    }
+}
+
+void hpsCameraViewVolume(HPScamera *camera, View *view){
+    view->planes = camera->planes;
+    view->x = camera->position.x;
+    view->y = camera->position.y;
+    view->z = camera->position.z;
+    view->sizeScale = camera->projection[5];
+    view->orthographic = (camera->projection[15] == 1);
+    view->minSize = camera->minSize;
+    view->camera = __builtin_ctz(camera->mask);
 }
 
 void hpsUpdateCamera(HPScamera *camera){
@@ -348,15 +510,26 @@ void hpsUpdateCamera(HPScamera *camera){
         exit(EXIT_FAILURE);
     }
     hpmMultMat4(c->projection, c->view, c->viewProjection);
+    c->culled = false;
 }
 
 void hpsRenderCamera(HPScamera *camera){
     currentCamera = *camera; // Set current camera to this one
     HPScamera *c = &currentCamera;
+    renderPass++;
     clearQueues();
     computePlanes(c);
-    c->scene->partitionInterface->doVisible(c->scene->partitionStruct,
-                                            c->planes, &addToQueue);
+    if (c->culled && c->culledVersion == c->scene->cullVersion){
+        int i;
+        for (i = 0; i < c->visibleNodes.size; i++)
+            addToQueue(c->visibleNodes.data[i]);
+        c->culled = false;
+    } else {
+        View view;
+        hpsCameraViewVolume(c, &view);
+        c->scene->partitionInterface->doVisible(c->scene->partitionStruct,
+                                                &view, &addToQueue);
+    }
     setCameraSort(c);
     hpsPreRenderExtensions(c->scene);
     renderQueues(c);
@@ -364,7 +537,60 @@ void hpsRenderCamera(HPScamera *camera){
     *camera = currentCamera; // Copy currentCamera back into camera
 }
 
+/* Multiple cameras */
+static void addToCameras(Node *node, unsigned int views){
+    while (views){
+        hpsPush(&cullingCameras[__builtin_ctz(views)]->visibleNodes, node);
+        views &= views - 1;
+    }
+}
+
+static void addToCamera(Node *node){
+    addToCameras(node, 1);
+}
+
+/* Cameras of one scene, at most MAX_VIEWS of them */
+static void cullCameras(HPScamera **cameras, unsigned int n){
+    HPSscene *scene = cameras[0]->scene;
+    PartitionInterface *partition = scene->partitionInterface;
+    View views[MAX_VIEWS];
+    unsigned int i;
+    for (i = 0; i < n; i++){
+        cameras[i]->culledVersion = scene->cullVersion;
+        computePlanes(cameras[i]);
+        hpsCameraViewVolume(cameras[i], &views[i]);
+    }
+    if (partition->doVisibleViews && n > 1){
+        cullingCameras = cameras;
+        partition->doVisibleViews(scene->partitionStruct, views, n, addToCameras);
+    } else {
+        for (i = 0; i < n; i++){
+            cullingCameras = &cameras[i];
+            partition->doVisible(scene->partitionStruct, &views[i], addToCamera);
+        }
+    }
+}
+
+void hpsCullCameras(HPScamera **cameras, unsigned int n){
+    HPScamera *group[MAX_VIEWS];
+    unsigned int i, j, nGroup;
+    for (i = 0; i < n; i++){
+        cameras[i]->culled = false;
+        cameras[i]->visibleNodes.size = 0;
+    }
+    for (i = 0; i < n; i++){
+        if (cameras[i]->culled) continue;
+        for (j = i, nGroup = 0; j < n && nGroup < MAX_VIEWS; j++)
+            if (!cameras[j]->culled && cameras[j]->scene == cameras[i]->scene){
+                cameras[j]->culled = true;
+                group[nGroup++] = cameras[j];
+            }
+        cullCameras(group, nGroup);
+    }
+}
+
 static void hpsOrthoCamera(HPScamera *camera){
+    camera->culled = false;
     float width = camera->vw * camera->vwRatio;
     float height = camera->vh * camera->vhRatio;
     float r = width * (0.5 + camera->vx);
@@ -377,6 +603,7 @@ static void hpsOrthoCamera(HPScamera *camera){
 }
 
 static void hpsPerspectiveCamera(HPScamera *camera){
+    camera->culled = false;
     float width = camera->vw * camera->vwRatio;
     float height = camera->vh * camera->vhRatio;
     float scale = tan(hpmDegreesToRadians(camera->viewAngle * 0.5)) 
@@ -392,6 +619,22 @@ static void hpsPerspectiveCamera(HPScamera *camera){
                        camera->projection);
 }
 
+/* Cameras past the 32nd share the last mask */
+static unsigned int newCameraMask(){
+    unsigned int mask = 1;
+    while (mask && (usedCameraMasks & mask)) mask <<= 1;
+    if (!mask) mask = 1u << 31;
+    if (mask == 1u << 31) lastMaskUsers++;
+    usedCameraMasks |= mask;
+    return mask;
+}
+
+/* The last mask is only free once no camera holds it */
+static void releaseCameraMask(unsigned int mask){
+    if (mask == 1u << 31 && --lastMaskUsers) return;
+    usedCameraMasks &= ~mask;
+}
+
 HPScamera *hpsMakeCamera(HPScameraType type, HPScameraStyle style, HPSscene *scene, float width, float height){
     HPScamera *camera = malloc(sizeof(struct camera));
     camera->n = HPS_DEFAULT_NEAR_PLANE;
@@ -422,12 +665,22 @@ HPScamera *hpsMakeCamera(HPScameraType type, HPScameraStyle style, HPSscene *sce
         camera->update = &hpsPerspectiveCamera;
     camera->style = style;
     camera->scene = scene;
+    camera->mask = newCameraMask();
+    camera->minSize = 0;
+    camera->culled = false;
+    camera->culledVersion = 0;
+    hpsInitVector(&camera->visibleNodes, 0);
     hpsPush(&cameraList, (void *) camera);
     hpsPush(&activeCameras, (void *) camera);
     camera->update(camera);
     return camera;
 }
 
+void hpsSetCameraMinSize(HPScamera *camera, float size){
+    camera->minSize = size;
+    camera->culled = false;
+}
+
 void hpsSetCameraClipPlanes(HPScamera *camera, float near, float far){
     camera->n = near;
     camera->f = far;
@@ -472,7 +725,11 @@ void hpsSetCameraViewportOffset(HPScamera *camera, float x, float y){
 
 void hpsDeleteCamera(HPScamera *camera){
     hpsDeactivateCamera(camera);
+    releaseCameraMask(camera->mask);
+    if (camera->scene->rateCamera == camera)
+        camera->scene->rateCamera = NULL;
     hpsRemove(&cameraList, (void *) camera);
+    hpsDeleteVector(&camera->visibleNodes);
     free(camera);
 }
 
@@ -637,6 +894,10 @@ void hpsStrafeCamera(HPScamera *camera, float dist){
     camera->position.z += dist * sinYaw;
 }
 
+unsigned int hpsCameraMask(HPScamera *camera){
+    return camera->mask;
+}
+
 float *hpsCameraProjection(HPScamera *camera){
     return camera->projection;
 }
@@ -657,6 +918,8 @@ void hpsUpdateCameras(){
 
 void hpsRenderCameras(){
     int i;
+    if (activeCameras.size > 1)
+        hpsCullCameras((HPScamera **) activeCameras.data, activeCameras.size);
     for (i = 0; i < activeCameras.size; i++)
 	hpsRenderCamera((HPScamera *) activeCameras.data[i]);
 }
@@ -675,4 +938,5 @@ void hpsInitCameras(){
     hpsInitVector(&activeCameras, 16);
     hpsInitVector(&renderQueue, 4096);
     hpsInitVector(&alphaQueue, 1024);
+    partPool = hpsMakePool(sizeof(PartEntry), 1024, "Prefab part pool");
 }
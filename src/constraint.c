@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "scene.h"
+
+/*
+  Constraints override part of a node's world transform. Look-at and follow constraints are solved once per update, after every other node has been updated. They are solved in order of their dependencies: a constraint comes after those on its node's ancestors, and those on its target and its target's ancestors, so that whatever it reads is final. Constraints that depend on each other in a cycle are solved in an arbitrary order. Constrained nodes, and the subtrees below them, are only brought up to date when their constraint is solved, so each is updated once. Billboards depend on the camera, so they are resolved when the node is rendered, leaving the node's own transform untouched.
+ */
+
+#define EPSILON 1e-6
+
+static bool setAxes(float *m, float *x, float *y, float *z){
+    if (hpmMagnitude(x) < EPSILON || hpmMagnitude(y) < EPSILON || hpmMagnitude(z) < EPSILON)
+        return false;
+    hpmNormalize(x);
+    hpmNormalize(y);
+    hpmNormalize(z);
+    memcpy(&m[0], x, sizeof(float) * 3);
+    memcpy(&m[4], y, sizeof(float) * 3);
+    memcpy(&m[8], z, sizeof(float) * 3);
+    m[3] = m[7] = m[11] = 0;
+    return true;
+}
+
+static void solveConstraint(HPSnode *node){
+    Constraint *c = &node->cold->constraint;
+    float *m = node->transform;
+    float *t = c->target->transform;
+    float x[3], y[3], z[3];
+    switch (node->constraint){
+    case HPS_CONSTRAINT_FOLLOW:
+        memcpy(z, &c->vector, sizeof(float) * 3);
+        hpmMat4VecMult(t, z);
+        memcpy(&m[12], z, sizeof(float) * 3);
+        break;
+    case HPS_CONSTRAINT_LOOK_AT:
+        // -z faces the target, as it does for cameras
+        hpmSubVec(&m[12], &t[12], z);
+        hpmCross((float *) &c->vector, z, x);
+        hpmCross(z, x, y);
+        setAxes(m, x, y, z);
+        break;
+    default:
+        break;
+    }
+}
+
+static bool isSolved(HPSnode *node){
+    return node->constraint == HPS_CONSTRAINT_LOOK_AT || node->constraint == HPS_CONSTRAINT_FOLLOW;
+}
+
+static unsigned int constraintOrder(HPSnode *node);
+
+/* Greatest order of the constraints on the node and its ancestors, 0 if the node is the scene */
+static unsigned int chainOrder(HPSnode *node, HPSscene *scene){
+    unsigned int order = 0, o;
+    for (; (HPSscene *) node != scene; node = node->parent)
+        if (isSolved(node) && (o = constraintOrder(node)) > order)
+            order = o;
+    return order;
+}
+
+/* Orders are cleared to 0 before sorting. A constraint is given a provisional order before its dependencies are looked at, which ends cycles */
+static unsigned int constraintOrder(HPSnode *node){
+    Constraint *c = &node->cold->constraint;
+    unsigned int order, o;
+    if (c->order) return c->order;
+    c->order = 1;
+    order = chainOrder(node->parent, node->scene);
+    if ((o = chainOrder(c->target, node->scene)) > order)
+        order = o;
+    c->order = order + 1;
+    return c->order;
+}
+
+static int byOrder(const void *a, const void *b){
+    unsigned int x = (*(HPSnode **) a)->cold->constraint.order;
+    unsigned int y = (*(HPSnode **) b)->cold->constraint.order;
+    return (x > y) - (x < y);
+}
+
+static void sortConstraints(HPSvector *nodes){
+    int i;
+    for (i = 0; i < nodes->size; i++)
+        ((HPSnode *) nodes->data[i])->cold->constraint.order = 0;
+    for (i = 0; i < nodes->size; i++)
+        constraintOrder(nodes->data[i]);
+    qsort(nodes->data, nodes->size, sizeof(void *), byOrder);
+}
+
+/* Nodes that the update reached are brought up to date here: their subtree is propagated if their transform changed, whether from their own movement or their constraint, and otherwise their children are updated as usual */
+void hpsSolveConstraints(HPSscene *scene){
+    HPSvector *nodes = &scene->constrainedNodes;
+    int i;
+    sortConstraints(nodes);
+    for (i = 0; i < nodes->size; i++){
+        HPSnode *node = nodes->data[i];
+        bool reached = node->constraintReached, moved = false;
+        float old[16];
+        node->constraintReached = false;
+        if (reached && node->needsUpdate){
+            hpsComputeNodeTransform(node);
+            moved = true;
+        }
+        memcpy(old, node->transform, sizeof(old));
+        solveConstraint(node);
+        moved |= memcmp(old, node->transform, sizeof(old)) != 0;
+        if (moved)
+            hpsTransformChanged(node);
+        else if (reached)
+            hpsUpdateChildren(node);
+    }
+}
+
+/* Called while deleted nodes are still allocated. Constrained nodes that are deleted are dropped, and those whose target is deleted lose their constraint */
+void hpsRemoveDeletedConstraints(HPSscene *scene){
+    HPSvector *nodes = &scene->constrainedNodes;
+    int i, j;
+    for (i = 0, j = 0; i < nodes->size; i++){
+        HPSnode *node = nodes->data[i];
+        if (node->isDeleted) continue;
+        if (node->cold->constraint.target->isDeleted){
+            node->constraint = HPS_CONSTRAINT_NONE;
+            node->cold->constraint.target = NULL;
+            node->needsUpdate = true;
+            continue;
+        }
+        nodes->data[j++] = node;
+    }
+    nodes->size = j;
+}
+
+void hpsSetNodeConstraint(HPSnode *node, HPSconstraint type, HPSnode *target, float *vector){
+    HPSscene *scene = node->scene;
+    Constraint *c = &node->cold->constraint;
+    bool solved = (type == HPS_CONSTRAINT_LOOK_AT || type == HPS_CONSTRAINT_FOLLOW);
+    if (solved && !target){
+        fprintf(stderr, "Constraint on node %p needs a target\n", node);
+        return;
+    }
+    if (solved && target->scene != scene){
+        fprintf(stderr, "Constraint target %p is not in the same scene as node %p\n", target, node);
+        return;
+    }
+    if (node->constraint == HPS_CONSTRAINT_LOOK_AT || node->constraint == HPS_CONSTRAINT_FOLLOW)
+        hpsRemove(&scene->constrainedNodes, node);
+    node->constraint = type;
+    c->target = solved ? target : NULL;
+    if (vector){
+        memcpy(&c->vector, vector, sizeof(float) * 3);
+    } else {
+        c->vector.x = 0;
+        c->vector.y = (type == HPS_CONSTRAINT_FOLLOW) ? 0 : 1;
+        c->vector.z = 0;
+    }
+    if (solved)
+        hpsPush(&scene->constrainedNodes, node);
+    node->needsUpdate = true;
+}
+
+/* Model matrix of a billboard node as seen by the camera, false if the node is not a billboard */
+bool hpsBillboardTransform(HPSnode *node, HPScamera *camera, float *dest){
+    Constraint *c = &node->cold->constraint;
+    float *view = camera->view;
+    float x[3], y[3], z[3];
+    memcpy(dest, node->transform, sizeof(float) * 16);
+    switch (node->constraint){
+    case HPS_CONSTRAINT_BILLBOARD:
+        // The rows of the view's rotation are the camera's axes
+        x[0] = view[0]; x[1] = view[4]; x[2] = view[8];
+        y[0] = view[1]; y[1] = view[5]; y[2] = view[9];
+        z[0] = view[2]; z[1] = view[6]; z[2] = view[10];
+        return setAxes(dest, x, y, z);
+    case HPS_CONSTRAINT_AXIAL_BILLBOARD:
+        memcpy(y, &c->vector, sizeof(float) * 3);
+        hpmSubVec((float *) &camera->position, &dest[12], z);
+        hpmCross(y, z, x);
+        hpmCross(x, y, z);
+        return setAxes(dest, x, y, z);
+    default:
+        return false;
+    }
+}
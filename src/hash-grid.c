@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "partition.h"
+#include "memory.h"
+
+/*
+  A uniform grid of cubes of hpsHashGridCellSize, of which only the occupied cells exist, found through a hash table of their coordinates. Each node is held by the cell its centre is in, so that adding, moving, and removing nodes costs the same no matter how many there are, and a node that moves within its cell costs nothing. Nodes with a radius of more than half of a cell are held apart, and tested individually. When culling, the cells that overlap the bounds of the view's frustum are looked up, unless there are fewer occupied cells than that, in which case every occupied cell is tested.
+ */
+
+#define CELL_NODES 6
+#define INITIAL_BUCKETS 1024
+#define MAX_COORDINATE 1e9 // Nodes further out than this many cells are held apart
+#define ALL_PLANES 63 // bx111111
+
+enum { RIGHT, LEFT, TOP, BOTTOM, NEAR, FAR };
+
+typedef struct hashGrid HashGrid;
+
+typedef struct cell {
+    struct cell *next; // In the same bucket
+    HashGrid *grid;
+    int x, y, z;
+    unsigned int index; // In the grid's occupied cells
+    float maxDistance; // Greatest maxDistance of the nodes added to the cell
+    HPSvector nodes;
+    Node *nodesData[CELL_NODES];
+} Cell;
+
+struct hashGrid {
+    HPSpool pool;
+    float cellSize;
+    Cell **buckets;
+    unsigned int nBuckets;
+    HPSvector cells; // Occupied cells
+    Cell apart; // Holds the nodes that don't fit in a cell
+};
+
+HashGrid *hpsHashGridNew();
+void hpsHashGridDelete(HashGrid *grid);
+void hpsHashGridAddNode(Node *node, HashGrid *grid);
+void hpsHashGridRemoveNode(Node *node);
+void hpsHashGridUpdateNode(Node *node);
+void hpsHashGridDoVisible(HashGrid *grid, View *view, void (*func)(Node *));
+
+float hpsHashGridCellSize = 16;
+unsigned int hpsHashGridPoolSize = 4096;
+
+static PartitionInterface hashGridInterface =
+    {(void *(*)()) hpsHashGridNew,
+     (void (*)(void *)) hpsHashGridDelete,
+     (void (*)(Node *, void *)) hpsHashGridAddNode,
+     NULL,
+     (void (*)(Node *)) hpsHashGridRemoveNode,
+     NULL,
+     (void (*)(Node *)) hpsHashGridUpdateNode,
+     (void (*)(void *, View *, void (*)(Node *))) hpsHashGridDoVisible,
+     NULL,
+     NULL};
+
+PartitionInterface *hpsHashGridPartitionInterface = &hashGridInterface;
+
+static unsigned int hash(HashGrid *grid, int x, int y, int z){
+    return ((unsigned int) x * 73856093u ^ (unsigned int) y * 19349663u ^
+            (unsigned int) z * 83492791u) & (grid->nBuckets - 1);
+}
+
+HashGrid *hpsHashGridNew(){
+    HashGrid *grid = malloc(sizeof(HashGrid));
+    grid->pool = hpsMakePool(sizeof(Cell), hpsHashGridPoolSize, "Hash grid pool");
+    grid->cellSize = hpsHashGridCellSize;
+    grid->nBuckets = INITIAL_BUCKETS;
+    grid->buckets = calloc(grid->nBuckets, sizeof(Cell *));
+    hpsInitVector(&grid->cells, 64);
+    hpsInitStaticVector(&grid->apart.nodes, grid->apart.nodesData, CELL_NODES);
+    grid->apart.grid = grid;
+    grid->apart.maxDistance = INFINITY;
+    return grid;
+}
+
+void hpsHashGridDelete(HashGrid *grid){
+    int i;
+    for (i = 0; i < grid->cells.size; i++)
+        hpsDeleteVector(&((Cell *) grid->cells.data[i])->nodes);
+    hpsDeleteVector(&grid->apart.nodes);
+    hpsDeleteVector(&grid->cells);
+    hpsDeletePool(grid->pool);
+    free(grid->buckets);
+    free(grid);
+}
+
+/* False if the node is held apart */
+static bool cellCoordinates(HashGrid *grid, BoundingSphere *bs, int *c){
+    float p[3] = {bs->x, bs->y, bs->z};
+    int j;
+    if (bs->r > grid->cellSize * 0.5) return false;
+    for (j = 0; j < 3; j++){
+        float f = floorf(p[j] / grid->cellSize);
+        if (!(fabsf(f) < MAX_COORDINATE)) return false;
+        c[j] = f;
+    }
+    return true;
+}
+
+static Cell *findCell(HashGrid *grid, int x, int y, int z){
+    Cell *cell = grid->buckets[hash(grid, x, y, z)];
+    while (cell && (cell->x != x || cell->y != y || cell->z != z))
+        cell = cell->next;
+    return cell;
+}
+
+static void growBuckets(HashGrid *grid){
+    unsigned int i;
+    free(grid->buckets);
+    grid->nBuckets *= 2;
+    grid->buckets = calloc(grid->nBuckets, sizeof(Cell *));
+    for (i = 0; i < grid->cells.size; i++){
+        Cell *cell = grid->cells.data[i];
+        unsigned int h = hash(grid, cell->x, cell->y, cell->z);
+        cell->next = grid->buckets[h];
+        grid->buckets[h] = cell;
+    }
+}
+
+static Cell *newCell(HashGrid *grid, int x, int y, int z){
+    Cell *cell = hpsAllocateFrom(grid->pool);
+    unsigned int h;
+    cell->grid = grid;
+    cell->x = x; cell->y = y; cell->z = z;
+    cell->maxDistance = -INFINITY;
+    hpsInitStaticVector(&cell->nodes, cell->nodesData, CELL_NODES);
+    cell->index = grid->cells.size;
+    hpsPush(&grid->cells, cell);
+    if (grid->cells.size > grid->nBuckets){
+        growBuckets(grid);
+    } else {
+        h = hash(grid, x, y, z);
+        cell->next = grid->buckets[h];
+        grid->buckets[h] = cell;
+    }
+    return cell;
+}
+
+static void deleteCell(Cell *cell){
+    HashGrid *grid = cell->grid;
+    Cell **c = &grid->buckets[hash(grid, cell->x, cell->y, cell->z)];
+    Cell *last;
+    while (*c != cell) c = &(*c)->next;
+    *c = cell->next;
+    last = grid->cells.data[--grid->cells.size];
+    grid->cells.data[cell->index] = last;
+    last->index = cell->index;
+    hpsDeleteVector(&cell->nodes);
+    hpsDeleteFrom(cell, grid->pool);
+}
+
+static void addNode(Node *node, HashGrid *grid){
+    int c[3];
+    Cell *cell;
+    if (cellCoordinates(grid, node->boundingSphere, c)){
+        cell = findCell(grid, c[0], c[1], c[2]);
+        if (!cell) cell = newCell(grid, c[0], c[1], c[2]);
+    } else {
+        cell = &grid->apart;
+    }
+    hpsPush(&cell->nodes, node);
+    cell->maxDistance = fmaxf(cell->maxDistance, node->maxDistance);
+    node->area = cell;
+}
+
+void hpsHashGridAddNode(Node *node, HashGrid *grid){
+    addNode(node, grid);
+}
+
+/* The order of a cell's nodes does not matter, so the last takes the place of the removed node */
+static bool removeNode(Node *node){
+    Cell *cell = node->area;
+    HPSvector *v = &cell->nodes;
+    int i;
+    for (i = 0; i < v->size; i++)
+        if (v->data[i] == node){
+            v->data[i] = v->data[--v->size];
+            if (!v->size && cell != &cell->grid->apart)
+                deleteCell(cell);
+            return true;
+        }
+    return false;
+}
+
+void hpsHashGridRemoveNode(Node *node){
+    if (!removeNode(node))
+        fprintf(stderr, "Warning, tried to remove node %p from a hash grid cell that it did not belong to\n", node->data);
+}
+
+void hpsHashGridUpdateNode(Node *node){
+    Cell *cell = node->area;
+    HashGrid *grid = cell->grid;
+    int c[3];
+    bool inCell = cellCoordinates(grid, node->boundingSphere, c);
+    if (inCell ? (cell != &grid->apart &&
+                  c[0] == cell->x && c[1] == cell->y && c[2] == cell->z)
+               : cell == &grid->apart){
+        cell->maxDistance = fmaxf(cell->maxDistance, node->maxDistance);
+        return;
+    }
+    removeNode(node);
+    addNode(node, grid);
+}
+
+/* Visibility testing */
+static void mapCell(Cell *cell, View *view, void (*func)(Node *), int planeMask){
+    Node **nodes = (Node **) cell->nodes.data;
+    int i;
+    for (i = 0; i < cell->nodes.size; i++){
+        BoundingSphere *bs = nodes[i]->boundingSphere;
+        if (hpsSphereInPlanes(view, bs->x, bs->y, bs->z, bs->r, planeMask) &&
+            hpsSphereInRange(view, bs->x, bs->y, bs->z, bs->r, nodes[i]->maxDistance))
+            func(nodes[i]);
+    }
+}
+
+/* A cell's nodes reach up to half a cell past it */
+static void testCell(Cell *cell, View *view, void (*func)(Node *)){
+    float size = cell->grid->cellSize;
+    float min[3] = {(cell->x - 0.5f) * size, (cell->y - 0.5f) * size, (cell->z - 0.5f) * size};
+    float max[3] = {min[0] + 2 * size, min[1] + 2 * size, min[2] + 2 * size};
+    int mask = 0;
+    if (hpsBoxInRange(view, min, max, size * 0.5, cell->maxDistance) &&
+        hpsBoxInPlanes(view, min, max, ALL_PLANES, &mask) >= 0)
+        mapCell(cell, view, func, mask);
+}
+
+/* The point where three planes meet, false if they do not */
+static bool intersection(Plane *a, Plane *b, Plane *c, float *p){
+    float bc[3] = {b->b * c->c - b->c * c->b, b->c * c->a - b->a * c->c, b->a * c->b - b->b * c->a};
+    float ca[3] = {c->b * a->c - c->c * a->b, c->c * a->a - c->a * a->c, c->a * a->b - c->b * a->a};
+    float ab[3] = {a->b * b->c - a->c * b->b, a->c * b->a - a->a * b->c, a->a * b->b - a->b * b->a};
+    float det = a->a * bc[0] + a->b * bc[1] + a->c * bc[2];
+    int j;
+    if (fabsf(det) < 1e-6) return false;
+    for (j = 0; j < 3; j++)
+        p[j] = -(a->d * bc[j] + b->d * ca[j] + c->d * ab[j]) / det;
+    return true;
+}
+
+/* Bounds of the frustum's eight corners, in cells */
+static bool frustumCells(HashGrid *grid, View *view, int *min, int *max){
+    float lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    Plane *p = view->planes;
+    int i, j, k, l;
+    for (i = RIGHT; i <= LEFT; i++)
+        for (j = TOP; j <= BOTTOM; j++)
+            for (k = NEAR; k <= FAR; k++){
+                float corner[3];
+                if (!intersection(&p[i], &p[j], &p[k], corner)) return false;
+                for (l = 0; l < 3; l++){
+                    lo[l] = fminf(lo[l], corner[l]);
+                    hi[l] = fmaxf(hi[l], corner[l]);
+                }
+            }
+    for (l = 0; l < 3; l++){
+        // Cells whose nodes could reach into the frustum
+        float a = floorf(lo[l] / grid->cellSize - 1.5), b = floorf(hi[l] / grid->cellSize + 0.5);
+        if (!(a > -MAX_COORDINATE && b < MAX_COORDINATE)) return false;
+        min[l] = a;
+        max[l] = b;
+    }
+    return true;
+}
+
+void hpsHashGridDoVisible(HashGrid *grid, View *view, void (*func)(Node *)){
+    int min[3], max[3], x, y, z;
+    unsigned int i;
+    mapCell(&grid->apart, view, func, ALL_PLANES);
+    if (frustumCells(grid, view, min, max) &&
+        (double) (max[0] - min[0] + 1) * (max[1] - min[1] + 1) * (max[2] - min[2] + 1)
+        < grid->cells.size){
+        for (z = min[2]; z <= max[2]; z++)
+            for (y = min[1]; y <= max[1]; y++)
+                for (x = min[0]; x <= max[0]; x++){
+                    Cell *cell = findCell(grid, x, y, z);
+                    if (cell) testCell(cell, view, func);
+                }
+    } else {
+        for (i = 0; i < grid->cells.size; i++)
+            testCell(grid->cells.data[i], view, func);
+    }
+}
@@ -0,0 +1,257 @@
+// Loose octree based off of:
+// Thatcher Ulrich, "Loose Octrees", Game Programming Gems (2000)
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "partition.h"
+#include "memory.h"
+
+/*
+  The octree covers a cube of hpsLooseOctreeSize, centred on the origin. The bounds of each cell are loosened to twice its size, so that a node fits in a cell as long as its centre is in the cell and its radius is no more than half of the cell's size. A node's cell is therefore found from its radius and position alone: the deepest level with large enough cells, and the cell of that level that holds the node's centre. Since cells do not depend on what they hold, a node that moves only touches the octree when it crosses into another cell. Nodes that are too large, or whose centre is outside of the octree, are held by the root.
+ */
+
+#define CELL_NODES 6
+#define MAX_DEPTH 16
+#define ALL_PLANES 63 // bx111111
+
+typedef struct looseOctree LooseOctree;
+
+typedef struct cell {
+    struct cell *parent;
+    struct cell *children[8];
+    LooseOctree *octree;
+    float min[3], max[3]; // Loose bounds
+    float maxRadius; // Largest node that the cell can hold
+    float maxDistance; // Greatest maxDistance of the nodes added to the cell and its children
+    unsigned int x, y, z; // Position of the cell within its level
+    unsigned char depth, nChildren;
+    HPSvector nodes;
+    Node *nodesData[CELL_NODES];
+} Cell;
+
+struct looseOctree {
+    HPSpool pool;
+    float size, origin;
+    unsigned int depth;
+};
+
+Cell *hpsLooseOctreeNew();
+void hpsLooseOctreeDelete(Cell *root);
+void hpsLooseOctreeAddNode(Node *node, Cell *root);
+void hpsLooseOctreeRemoveNode(Node *node);
+void hpsLooseOctreeUpdateNode(Node *node);
+void hpsLooseOctreeDoVisible(Cell *root, View *view, void (*func)(Node *));
+
+float hpsLooseOctreeSize = 4096;
+unsigned int hpsLooseOctreeDepth = 8;
+unsigned int hpsLooseOctreePoolSize = 4096;
+
+static PartitionInterface looseOctreeInterface =
+    {(void *(*)()) hpsLooseOctreeNew,
+     (void (*)(void *)) hpsLooseOctreeDelete,
+     (void (*)(Node *, void *)) hpsLooseOctreeAddNode,
+     NULL,
+     (void (*)(Node *)) hpsLooseOctreeRemoveNode,
+     NULL,
+     (void (*)(Node *)) hpsLooseOctreeUpdateNode,
+     (void (*)(void *, View *, void (*)(Node *))) hpsLooseOctreeDoVisible,
+     NULL,
+     NULL};
+
+PartitionInterface *hpsLooseOctreePartitionInterface = &looseOctreeInterface;
+
+static Cell *newCell(LooseOctree *octree, Cell *parent, int child){
+    Cell *cell = hpsAllocateFrom(octree->pool);
+    unsigned int c[3];
+    float size;
+    int j;
+    hpsInitStaticVector(&cell->nodes, cell->nodesData, CELL_NODES);
+    memset(cell->children, 0, 8 * sizeof(Cell *));
+    cell->parent = parent;
+    cell->octree = octree;
+    cell->nChildren = 0;
+    cell->maxDistance = -INFINITY;
+    if (parent){
+        cell->depth = parent->depth + 1;
+        cell->x = parent->x * 2 + (child & 1);
+        cell->y = parent->y * 2 + ((child >> 1) & 1);
+        cell->z = parent->z * 2 + ((child >> 2) & 1);
+        parent->children[child] = cell;
+        parent->nChildren++;
+    } else {
+        cell->depth = 0;
+        cell->x = cell->y = cell->z = 0;
+    }
+    size = octree->size / (1u << cell->depth);
+    c[0] = cell->x; c[1] = cell->y; c[2] = cell->z;
+    for (j = 0; j < 3; j++){
+        cell->min[j] = octree->origin + c[j] * size - size * 0.5;
+        cell->max[j] = octree->origin + (c[j] + 1) * size + size * 0.5;
+    }
+    cell->maxRadius = size * 0.5;
+    return cell;
+}
+
+Cell *hpsLooseOctreeNew(){
+    LooseOctree *octree = malloc(sizeof(LooseOctree));
+    octree->pool = hpsMakePool(sizeof(Cell), hpsLooseOctreePoolSize, "Loose octree pool");
+    octree->size = hpsLooseOctreeSize;
+    octree->origin = -hpsLooseOctreeSize * 0.5;
+    octree->depth = hpsLooseOctreeDepth;
+    if (octree->depth > MAX_DEPTH){
+        fprintf(stderr, "Loose octrees can be no deeper than %d, not %u\n",
+                MAX_DEPTH, octree->depth);
+        octree->depth = MAX_DEPTH;
+    }
+    return newCell(octree, NULL, 0);
+}
+
+static void deleteCell(Cell *cell){
+    int i;
+    for (i = 0; i < 8; i++)
+        if (cell->children[i]) deleteCell(cell->children[i]);
+    hpsDeleteVector(&cell->nodes);
+}
+
+void hpsLooseOctreeDelete(Cell *root){
+    LooseOctree *octree = root->octree;
+    deleteCell(root);
+    hpsDeletePool(octree->pool);
+    free(octree);
+}
+
+/* The level and position of the cell that a node belongs in. Level 0 is the root */
+static unsigned int locate(LooseOctree *octree, BoundingSphere *bs, unsigned int *c){
+    float p[3] = {bs->x, bs->y, bs->z};
+    int depth, j;
+    c[0] = c[1] = c[2] = 0;
+    // Deepest level whose cells are at least twice the radius
+    if (bs->r > 0){
+        frexpf(octree->size / (2 * bs->r), &depth);
+        depth = (depth - 1 < (int) octree->depth) ? depth - 1 : octree->depth;
+        if (depth <= 0) return 0;
+    } else {
+        depth = octree->depth;
+    }
+    unsigned int n = 1u << depth;
+    for (j = 0; j < 3; j++){
+        float f = (p[j] - octree->origin) / octree->size * n;
+        if (!(f >= 0 && f < n)){
+            c[0] = c[1] = c[2] = 0;
+            return 0;
+        }
+        c[j] = f;
+    }
+    return depth;
+}
+
+static Cell *findCell(Cell *root, BoundingSphere *bs){
+    unsigned int c[3];
+    unsigned int depth = locate(root->octree, bs, c);
+    unsigned int level;
+    Cell *cell = root;
+    for (level = 1; level <= depth; level++){
+        unsigned int shift = depth - level;
+        int i = ((c[0] >> shift) & 1) | (((c[1] >> shift) & 1) << 1) |
+            (((c[2] >> shift) & 1) << 2);
+        cell = cell->children[i] ? cell->children[i] : newCell(root->octree, cell, i);
+    }
+    return cell;
+}
+
+static void growDistance(Cell *cell, float maxDistance){
+    for (; cell && cell->maxDistance < maxDistance; cell = cell->parent)
+        cell->maxDistance = maxDistance;
+}
+
+static void addNode(Node *node, Cell *cell){
+    hpsPush(&cell->nodes, node);
+    node->area = cell;
+    growDistance(cell, node->maxDistance);
+}
+
+void hpsLooseOctreeAddNode(Node *node, Cell *root){
+    addNode(node, findCell(root, node->boundingSphere));
+}
+
+static void maybeKillCell(Cell *cell){
+    while (cell->parent && !cell->nodes.size && !cell->nChildren){
+        Cell *parent = cell->parent;
+        parent->children[(cell->x & 1) | ((cell->y & 1) << 1) | ((cell->z & 1) << 2)] = NULL;
+        parent->nChildren--;
+        hpsDeleteVector(&cell->nodes);
+        hpsDeleteFrom(cell, cell->octree->pool);
+        cell = parent;
+    }
+}
+
+/* The order of a cell's nodes does not matter, so the last takes the place of the removed node */
+static bool removeNode(Node *node, Cell *cell){
+    HPSvector *v = &cell->nodes;
+    int i;
+    for (i = 0; i < v->size; i++)
+        if (v->data[i] == node){
+            v->data[i] = v->data[--v->size];
+            return true;
+        }
+    return false;
+}
+
+void hpsLooseOctreeRemoveNode(Node *node){
+    Cell *cell = node->area;
+    if (!removeNode(node, cell)){
+        fprintf(stderr, "Warning, tried to remove node %p from a loose octree cell that it did not belong to\n", node->data);
+        return;
+    }
+    maybeKillCell(cell);
+}
+
+void hpsLooseOctreeUpdateNode(Node *node){
+    Cell *cell = node->area;
+    Cell *root = cell;
+    unsigned int c[3];
+    if (locate(cell->octree, node->boundingSphere, c) == cell->depth &&
+        c[0] == cell->x && c[1] == cell->y && c[2] == cell->z){
+        growDistance(cell, node->maxDistance);
+        return;
+    }
+    while (root->parent) root = root->parent;
+    removeNode(node, cell);
+    addNode(node, findCell(root, node->boundingSphere));
+    maybeKillCell(cell);
+}
+
+/* Visibility testing */
+static void mapCell(Cell *cell, View *view, void (*func)(Node *), int planeMask){
+    Node **nodes = (Node **) cell->nodes.data;
+    int i;
+    for (i = 0; i < cell->nodes.size; i++){
+        BoundingSphere *bs = nodes[i]->boundingSphere;
+        if (hpsSphereInPlanes(view, bs->x, bs->y, bs->z, bs->r, planeMask) &&
+            hpsSphereInRange(view, bs->x, bs->y, bs->z, bs->r, nodes[i]->maxDistance))
+            func(nodes[i]);
+    }
+}
+
+static void doVisible(Cell *cell, View *view, void (*func)(Node *), int planeMask){
+    int nextMask = 0;
+    int i;
+    if (!hpsBoxInRange(view, cell->min, cell->max, cell->maxRadius, cell->maxDistance) ||
+        hpsBoxInPlanes(view, cell->min, cell->max, planeMask, &nextMask) < 0)
+        return;
+    mapCell(cell, view, func, nextMask);
+    for (i = 0; i < 8; i++)
+        if (cell->children[i])
+            doVisible(cell->children[i], view, func, nextMask);
+}
+
+/* The root may hold nodes that are outside of its bounds, so it is never culled as a whole */
+void hpsLooseOctreeDoVisible(Cell *root, View *view, void (*func)(Node *)){
+    int i;
+    mapCell(root, view, func, ALL_PLANES);
+    for (i = 0; i < 8; i++)
+        if (root->children[i])
+            doVisible(root->children[i], view, func, ALL_PLANES);
+}
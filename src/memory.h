@@ -4,6 +4,7 @@
 #include <stdbool.h>
 
 #define DEFAULT_VECTOR_SIZE 4
+#define CACHE_LINE_SIZE 64
 
 struct pool{
     unsigned int blockSize;
@@ -11,6 +12,7 @@ struct pool{
     void **freeBlock;
     void *nextPool;
     char name[32];
+    bool isFixed; // Lives in a caller-provided region, so it cannot grow
 };
 
 typedef struct {
@@ -27,6 +29,8 @@ HPSpool hpsMakePool(size_t blockSize, size_t nBlocks, char name[32]);
 
 void hpsInitPool(HPSpool pool, void *data, size_t blockSize, size_t nBlocks, char name[32]);
 
+HPSpool hpsMakePoolIn(void *region, size_t regionSize, size_t blockSize, char name[32]);
+
 void hpsDeletePool(HPSpool pool);
 
 void hpsClearPool(HPSpool pool);
@@ -35,6 +39,12 @@ void *hpsAllocateFrom(HPSpool pool);
 
 void hpsDeleteFrom(void *block, HPSpool pool);
 
+void hpsDeleteManyFrom(void **blocks, size_t n, HPSpool pool);
+
+size_t hpsPoolBlockIndex(HPSpool pool, void *block);
+
+void *hpsPoolChunk(HPSpool pool, size_t n, size_t *first, size_t *nBlocks);
+
 /* Vectors */
 void hpsInitVector(HPSvector *vector, size_t initialCapacity);
 
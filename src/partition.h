@@ -1,3 +1,6 @@
+#include <stdbool.h>
+#include <math.h>
+
 // The position and size of a node
 typedef struct {
     float x, y, z, r;
@@ -8,18 +11,101 @@ typedef struct {
     float a, b, c, d;
 } Plane;
 
+// What a camera can see, passed to doVisible
+typedef struct {
+    Plane *planes; // Right, left, top, bottom, near, and far planes, with unit normals pointing in
+    float x, y, z; // Position of the camera
+    float sizeScale; // A sphere of radius r at distance d covers r * sizeScale / d of the viewport's height (r * sizeScale when orthographic)
+    float minSize; // Nodes that cover less than this are not visible, 0 if every node is
+    bool orthographic;
+    unsigned int camera; // Which camera is culling, from 0 to 31 (later cameras share 31), so that partitions can keep state for each camera between frames
+} View;
+
 typedef struct {
     BoundingSphere *boundingSphere;
     void *area; // For use by the partition: what area is this node in?
     void *data; // Data used by Hyperscene
+    unsigned int slot; // For use by the partition: where in its area is this node?
+    float maxDistance; // Nodes further than this from the camera are not visible
 } Node;
 
 typedef struct partitionInterface{
     void *(*new)(); // Create and return a new partition for a scene
     void (*delete)(void *); // Delete the given partition
     void (*addNode)(Node *, void *); // Add a node to a scene
+    void (*addNodes)(Node **, size_t, void *); // Add a batch of nodes to a scene. May be NULL, in which case addNode is called for each
     void (*removeNode)(Node *); // Remove a node
+    void (*removeNodes)(Node **, size_t); // Remove a batch of nodes at once. May be NULL, in which case removeNode is called for each
     void (*updateNode)(Node *); // Called when a node has moved
-    // For the given partition (arg 1) and a set of six planes (arg 2), call the given function (arg 3) with every node that is inside all six planes
-    void (*doVisible)(void *, Plane *, void (*)(Node *));
+    // For the given partition (arg 1) and view (arg 2), call the given function (arg 3) with every node that is inside all six planes, closer than its maxDistance, and no smaller than the view's minSize. It must not change the partition, other than state that it keeps for the view's camera alone, so that different cameras can be culled at the same time: bounds that culling relies on have to be kept large enough as nodes change, and tightened in maintain
+    void (*doVisible)(void *, View *, void (*)(Node *));
+    // Do pending work on the partition (arg 1), such as recomputing bounds or splitting cells, stopping once about the given amount of work (arg 2, in nodes looked at) is done, and return the amount done. doVisible must stay correct without it. May be NULL, for partitions that do all of their work as nodes change
+    unsigned int (*maintain)(void *, unsigned int);
+    // For the given partition (arg 1) and views (arg 2, at most 32 of them, arg 3), call the given function (arg 4) once with every node that is visible from any of the views, along with a mask whose bit i is set when the node is visible from view i. May be NULL, in which case doVisible is called for each view
+    void (*doVisibleViews)(void *, View *, unsigned int, void (*)(Node *, unsigned int));
 } PartitionInterface;
+
+// Number of cells in an AABB tree partition, adding the bytes they take to cellBytes, and the bytes they use on the heap to heapBytes
+size_t hpsAABBmemoryUse(void *tree, size_t *cellBytes, size_t *heapBytes);
+
+/* Tests shared by partitions */
+
+// Whether a node's bounding sphere is close enough to, and large enough from, the view's position
+static inline bool hpsSphereInRange(View *view, float x, float y, float z, float r,
+                                    float maxDistance){
+    float dx = x - view->x, dy = y - view->y, dz = z - view->z;
+    float d2 = dx*dx + dy*dy + dz*dz;
+    float reach = maxDistance + r;
+    if (d2 > reach * reach) return false;
+    if (view->minSize > 0){
+        float s = view->minSize / view->sizeScale;
+        return view->orthographic ? r * r >= s*s : r * r >= s*s*d2;
+    }
+    return true;
+}
+
+// Whether a sphere is on the inside of each of the view's planes given in planeMask
+static inline bool hpsSphereInPlanes(View *view, float x, float y, float z, float r,
+                                     int planeMask){
+    int i;
+    for (i = 0; i < 6; i++){
+        Plane *p = &view->planes[i];
+        if ((planeMask & (1 << i)) && p->a * x + p->b * y + p->c * z + p->d < -r)
+            return false;
+    }
+    return true;
+}
+
+// Whether a box could hold a visible node no larger than maxRadius and no further visible than maxDistance
+static inline bool hpsBoxInRange(View *view, float *min, float *max, float maxRadius,
+                                 float maxDistance){
+    float dx = fmaxf(fmaxf(min[0] - view->x, view->x - max[0]), 0);
+    float dy = fmaxf(fmaxf(min[1] - view->y, view->y - max[1]), 0);
+    float dz = fmaxf(fmaxf(min[2] - view->z, view->z - max[2]), 0);
+    float d2 = dx*dx + dy*dy + dz*dz;
+    if (d2 > maxDistance * maxDistance) return false;
+    if (view->minSize > 0){
+        float s = view->minSize / view->sizeScale;
+        return view->orthographic ? maxRadius >= s : maxRadius * maxRadius >= s*s*d2;
+    }
+    return true;
+}
+
+// -1 if a box is outside one of the view's planes given in planeMask, 1 if it is inside them all, otherwise 0, with the planes it crosses added to outMask
+static inline int hpsBoxInPlanes(View *view, float *min, float *max, int planeMask,
+                                 int *outMask){
+    int i, result = 1;
+    for (i = 0; i < 6; i++){
+        Plane *p = &view->planes[i];
+        if (!(planeMask & (1 << i))) continue;
+        float px = (p->a < 0) ? min[0] : max[0], nx = (p->a < 0) ? max[0] : min[0];
+        float py = (p->b < 0) ? min[1] : max[1], ny = (p->b < 0) ? max[1] : min[1];
+        float pz = (p->c < 0) ? min[2] : max[2], nz = (p->c < 0) ? max[2] : min[2];
+        if (p->a * px + p->b * py + p->c * pz + p->d < 0) return -1;
+        if (p->a * nx + p->b * ny + p->c * nz + p->d < 0){
+            *outMask |= 1 << i;
+            result = 0;
+        }
+    }
+    return result;
+}
@@ -10,6 +10,7 @@ void hpsInitPool(HPSpool pool, void *data, size_t blockSize, size_t nBlocks, cha
     p->blockSize = blockSize;
     p->nBlocks = nBlocks;
     p->nextPool = NULL;
+    p->isFixed = false;
     p->freeBlock = (void**) data;
     strcpy(p->name, name);
     for(i = 0; i < nBlocks - 1; i++){
@@ -20,27 +21,45 @@ void hpsInitPool(HPSpool pool, void *data, size_t blockSize, size_t nBlocks, cha
     *last = NULL;
 }
 
+/* Pools start on a cache line, so that blocks whose size is a multiple of a cache line are aligned to one */
 HPSpool hpsMakePool(size_t blockSize, size_t nBlocks, char name[32]){
     size_t size = (blockSize < sizeof(void *)) ? sizeof(void *) : blockSize;
-    char *pool = (char *) malloc(size * nBlocks + sizeof(struct pool));
+    char *pool;
+    if (posix_memalign((void **) &pool, CACHE_LINE_SIZE, size * nBlocks + sizeof(struct pool))){
+	fprintf(stderr, "Could not allocate pool: %s\n", name);
+	exit(EXIT_FAILURE);
+    }
     char *poolStart = &pool[sizeof(struct pool)];
     hpsInitPool((struct pool*) pool, poolStart, size, nBlocks, name);
     return (void *) pool;
 }
 
+/* The pool's header is placed at the start of the region, followed by as many blocks as fit */
+HPSpool hpsMakePoolIn(void *region, size_t regionSize, size_t blockSize, char name[32]){
+    size_t size = (blockSize < sizeof(void *)) ? sizeof(void *) : blockSize;
+    if (regionSize < sizeof(struct pool) + size){
+	fprintf(stderr, "Region is too small to hold pool: %s\n", name);
+	return NULL;
+    }
+    char *poolStart = &((char *) region)[sizeof(struct pool)];
+    hpsInitPool(region, poolStart, size, (regionSize - sizeof(struct pool)) / size, name);
+    ((struct pool*) region)->isFixed = true;
+    return region;
+}
+
 void hpsDeletePool(HPSpool pool){
     struct pool *data = (struct pool*) pool;
     if (data->nextPool)
 	hpsDeletePool(data->nextPool);
-    free(pool);
+    if (!data->isFixed)
+	free(pool);
 }
 
-void hpsClearPool(HPSpool pool){
+/* Each chunk's last block links to the first block of the next, so that the whole chain is one free list starting at the head, and chunks the pool has grown are reused */
+static void **clearChunk(struct pool *data){
     int i;
-    struct pool *data = (struct pool*) pool;
-    if (data->nextPool)
-	hpsClearPool(data->nextPool);
-    char *poolStart = &((char *) pool)[sizeof(struct pool)];
+    void **after = data->nextPool ? clearChunk(data->nextPool) : NULL;
+    char *poolStart = &((char *) data)[sizeof(struct pool)];
     const unsigned int size = data->blockSize;
     const unsigned int nBlocks = data->nBlocks;
     data->freeBlock = (void**) poolStart;
@@ -49,7 +68,12 @@ void hpsClearPool(HPSpool pool){
 	*next = &poolStart[(i+1) * size];
     }
     void **last = (void **) &poolStart[(nBlocks - 1) * size];
-    *last = NULL;
+    *last = after;
+    return data->freeBlock;
+}
+
+void hpsClearPool(HPSpool pool){
+    clearChunk((struct pool*) pool);
 }
 
 static HPSpool newestPool(HPSpool pool){
@@ -82,6 +106,10 @@ void *hpsAllocateFrom(HPSpool pool){
     struct pool *data = (struct pool*) pool;
     void **block = data->freeBlock;
     if (!block){
+	if (data->isFixed){
+	    fprintf(stderr, "Pool is full and cannot grow: %s\n", data->name);
+	    return NULL;
+	}
 	growPool(pool);
 	block = data->freeBlock;
     }
@@ -95,3 +123,42 @@ void hpsDeleteFrom(void *block, HPSpool pool){
     *b = data->freeBlock;
     data->freeBlock = b;
 }
+
+void hpsDeleteManyFrom(void **blocks, size_t n, HPSpool pool){
+    struct pool *data = (struct pool*) pool;
+    size_t i;
+    if (!n) return;
+    for (i = 0; i < n - 1; i++)
+	*((void **) blocks[i]) = blocks[i + 1];
+    *((void **) blocks[n - 1]) = data->freeBlock;
+    data->freeBlock = (void **) blocks[0];
+}
+
+/* Blocks are numbered consecutively through every pool in the chain */
+size_t hpsPoolBlockIndex(HPSpool pool, void *block){
+    struct pool *data = (struct pool*) pool;
+    size_t base = 0;
+    while (data){
+	char *poolStart = &((char *) data)[sizeof(struct pool)];
+	char *b = (char *) block;
+	if (b >= poolStart && b < poolStart + data->blockSize * data->nBlocks)
+	    return base + (b - poolStart) / data->blockSize;
+	base += data->nBlocks;
+	data = (struct pool*) data->nextPool;
+    }
+    return (size_t) -1;
+}
+
+/* The blocks of the nth pool in the chain, along with the index of its first block */
+void *hpsPoolChunk(HPSpool pool, size_t n, size_t *first, size_t *nBlocks){
+    struct pool *data = (struct pool*) pool;
+    size_t base = 0;
+    for (; data && n; n--){
+	base += data->nBlocks;
+	data = (struct pool*) data->nextPool;
+    }
+    if (!data) return NULL;
+    *first = base;
+    *nBlocks = data->nBlocks;
+    return &((char *) data)[sizeof(struct pool)];
+}
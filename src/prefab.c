@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "scene.h"
+
+/*
+  A prefab is a template for a tree of parts that is shared by all of its instances. An instance is a single node: only it is updated and added to the scene's partition. The transform of every part relative to the root of the prefab is computed once, so the world transform of a part is a single multiplication with the instance's transform, done when the instance is visible.
+ */
+
+HPSprefab *hpsMakePrefab(){
+    HPSprefab *prefab = malloc(sizeof(HPSprefab));
+    prefab->parts = NULL;
+    prefab->nParts = 0;
+    prefab->capacity = 0;
+    prefab->nInstances = 0;
+    memset(&prefab->bounds, 0, sizeof(BoundingSphere));
+    return prefab;
+}
+
+void hpsDeletePrefab(HPSprefab *prefab){
+    if (prefab->nInstances){
+        fprintf(stderr, "Prefab %p still has %u instances, not deleting it\n", prefab, prefab->nInstances);
+        return;
+    }
+    free(prefab->parts);
+    free(prefab);
+}
+
+/* Smallest sphere centered at the middle of the parts' extents that contains every part */
+static void updateBounds(HPSprefab *prefab){
+    float min[3], max[3];
+    BoundingSphere *b = &prefab->bounds;
+    int i, j;
+    for (j = 0; j < 3; j++){
+        min[j] = INFINITY;
+        max[j] = -INFINITY;
+    }
+    for (i = 0; i < prefab->nParts; i++){
+        float *bs = (float *) &prefab->parts[i].boundingSphere;
+        for (j = 0; j < 3; j++){
+            min[j] = fminf(min[j], bs[j] - bs[3]);
+            max[j] = fmaxf(max[j], bs[j] + bs[3]);
+        }
+    }
+    b->x = (min[0] + max[0]) * 0.5;
+    b->y = (min[1] + max[1]) * 0.5;
+    b->z = (min[2] + max[2]) * 0.5;
+    b->r = 0;
+    for (i = 0; i < prefab->nParts; i++){
+        BoundingSphere *bs = &prefab->parts[i].boundingSphere;
+        float dx = bs->x - b->x, dy = bs->y - b->y, dz = bs->z - b->z;
+        b->r = fmaxf(b->r, sqrtf(dx*dx + dy*dy + dz*dz) + bs->r);
+    }
+}
+
+int hpsAddPrefabPart(HPSprefab *prefab, int parent, void *data, HPSpipeline *pipeline,
+                     float *position, float *rotation, float radius){
+    if (parent >= (int) prefab->nParts){
+        fprintf(stderr, "Prefab %p does not have a part %d\n", prefab, parent);
+        return -1;
+    }
+    if (prefab->nParts == prefab->capacity){
+        prefab->capacity = prefab->capacity ? prefab->capacity * 2 : 8;
+        prefab->parts = realloc(prefab->parts, prefab->capacity * sizeof(PrefabPart));
+    }
+    PrefabPart *part = &prefab->parts[prefab->nParts];
+    float trans[16];
+    part->parent = parent;
+    part->data = data;
+    part->pipeline = pipeline;
+    hpmQuaternionRotation(rotation, trans);
+    hpmTranslate(position, trans);
+    if (parent < 0)
+        memcpy(part->transform, trans, sizeof(float) * 16);
+    else
+        hpmMultMat4(trans, prefab->parts[parent].transform, part->transform);
+    memset(&part->boundingSphere, 0, 3 * sizeof(float));
+    hpmMat4VecMult(part->transform, (float *) &part->boundingSphere);
+    part->boundingSphere.r = radius;
+    prefab->nParts++;
+    updateBounds(prefab);
+    return prefab->nParts - 1;
+}
+
+HPSnode *hpsAddPrefabInstance(HPSnode *parent, HPSprefab *prefab, void *data,
+                              void (*deleteFunc)(void *)){
+    HPSnode *node = hpsNewNode(parent, data, NULL, deleteFunc);
+    if (!node) return NULL;
+    node->cold->prefab = prefab;
+    node->isPrefab = true;
+    prefab->nInstances++;
+    if (node->scene->shared) hpsBeginSharedUpdate(node->scene);
+    *node->partitionData.boundingSphere = prefab->bounds;
+    if (node->scene->shared) hpsEndSharedUpdate(node->scene);
+    node->scene->partitionInterface->addNode(&node->partitionData,
+                                             node->scene->partitionStruct);
+    return node;
+}
+
+static bool isInstance(HPSnode *node, int part){
+    if (!node->isPrefab){
+        fprintf(stderr, "Node %p is not a prefab instance\n", node);
+        return false;
+    }
+    if (part < 0 || part >= node->cold->prefab->nParts){
+        fprintf(stderr, "Prefab %p does not have a part %d\n", node->cold->prefab, part);
+        return false;
+    }
+    return true;
+}
+
+/* Overrides are only allocated once an instance first needs one, and grow with parts that are added to the prefab later */
+void hpsOverridePrefabPart(HPSnode *instance, int part, void *data, HPSpipeline *pipeline){
+    NodeCold *cold = instance->cold;
+    int i;
+    if (!isInstance(instance, part)) return;
+    HPSprefab *prefab = cold->prefab;
+    if (part >= cold->nPrefabOverrides){
+        cold->prefabOverrides = realloc(cold->prefabOverrides,
+                                        prefab->nParts * sizeof(PrefabOverride));
+        for (i = cold->nPrefabOverrides; i < prefab->nParts; i++){
+            cold->prefabOverrides[i].data = prefab->parts[i].data;
+            cold->prefabOverrides[i].pipeline = prefab->parts[i].pipeline;
+        }
+        cold->nPrefabOverrides = prefab->nParts;
+    }
+    cold->prefabOverrides[part].data = data;
+    cold->prefabOverrides[part].pipeline = pipeline;
+}
+
+void hpsPrefabPartTransform(HPSnode *instance, int part, float *dest){
+    if (!isInstance(instance, part)) return;
+    hpmMultMat4(instance->cold->prefab->parts[part].transform, instance->transform, dest);
+}
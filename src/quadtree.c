@@ -0,0 +1,361 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "partition.h"
+#include "memory.h"
+
+/*
+  A loose quadtree over the two axes other than hpsQuadtreeAxis, covering a square of hpsQuadtreeSize centred on the origin. Like the loose octree, each quad's bounds are loosened to twice its size, so a node belongs in any quad its centre is in, as long as its radius is no more than half of the quad's size. Quads only split once they hold more than hpsQuadtreeLeafNodes nodes, after which the nodes that fit are passed down to the new quads. Nodes that are too large, or whose centre is outside of the quadtree, are held by the root.
+
+  Along the ignored axis, every quad is taken to span the range of all of the nodes, which never shrinks. The view's planes can then be reduced to lines on the ground plane once per cull, and the quads tested against those lines, leaving out planes that no quad can cross.
+ */
+
+#define QUAD_NODES 8 // Nodes held in the quad itself, more are stored on the heap
+#define MAX_DEPTH 24
+#define ALL_PLANES 63 // bx111111
+
+enum { X_AXIS, Y_AXIS, Z_AXIS };
+
+typedef struct quadtree Quadtree;
+
+typedef struct quad {
+    struct quad *parent;
+    struct quad *children[4];
+    Quadtree *tree;
+    float u, v; // Smallest corner of the quad, along the ground axes
+    float size;
+    float maxDistance; // Greatest maxDistance of the nodes added to the quad and its children
+    float nearestMaxDistance; // Smallest maxDistance of the nodes added to the quad itself
+    unsigned char depth, nChildren;
+    bool split;
+    HPSvector nodes;
+    BoundingSphere *spheres; // Copies of the nodes' bounding spheres, so culling does not touch the nodes
+    unsigned int sphereCapacity;
+    Node *nodesData[QUAD_NODES];
+    BoundingSphere spheresData[QUAD_NODES];
+} Quad;
+
+struct quadtree {
+    HPSpool pool;
+    unsigned int axis, u, v; // The ignored axis, then the two ground axes
+    float upMin, upMax; // Range of the nodes along the ignored axis
+    unsigned int leafNodes;
+    Quad *root;
+};
+
+// A plane reduced to the ground axes: the side of the line that is in, given the highest and lowest that the plane gets over the range of the ignored axis
+typedef struct {
+    float a, b, high, low;
+} Line;
+
+Quadtree *hpsQuadtreeNew();
+void hpsQuadtreeDelete(Quadtree *tree);
+void hpsQuadtreeAddNode(Node *node, Quadtree *tree);
+void hpsQuadtreeRemoveNode(Node *node);
+void hpsQuadtreeUpdateNode(Node *node);
+void hpsQuadtreeDoVisible(Quadtree *tree, View *view, void (*func)(Node *));
+
+unsigned int hpsQuadtreeAxis = Y_AXIS;
+float hpsQuadtreeSize = 4096;
+unsigned int hpsQuadtreeLeafNodes = 64;
+unsigned int hpsQuadtreePoolSize = 4096;
+
+static PartitionInterface quadtreeInterface =
+    {(void *(*)()) hpsQuadtreeNew,
+     (void (*)(void *)) hpsQuadtreeDelete,
+     (void (*)(Node *, void *)) hpsQuadtreeAddNode,
+     NULL,
+     (void (*)(Node *)) hpsQuadtreeRemoveNode,
+     NULL,
+     (void (*)(Node *)) hpsQuadtreeUpdateNode,
+     (void (*)(void *, View *, void (*)(Node *))) hpsQuadtreeDoVisible,
+     NULL,
+     NULL};
+
+PartitionInterface *hpsQuadtreePartitionInterface = &quadtreeInterface;
+
+static Quad *newQuad(Quadtree *tree, Quad *parent, float u, float v, float size){
+    Quad *q = hpsAllocateFrom(tree->pool);
+    q->parent = parent;
+    memset(q->children, 0, 4 * sizeof(Quad *));
+    q->tree = tree;
+    q->u = u;
+    q->v = v;
+    q->size = size;
+    q->maxDistance = -INFINITY;
+    q->nearestMaxDistance = INFINITY;
+    q->depth = parent ? parent->depth + 1 : 0;
+    q->nChildren = 0;
+    q->split = false;
+    hpsInitStaticVector(&q->nodes, q->nodesData, QUAD_NODES);
+    q->spheres = q->spheresData;
+    q->sphereCapacity = QUAD_NODES;
+    return q;
+}
+
+Quadtree *hpsQuadtreeNew(){
+    Quadtree *tree = malloc(sizeof(Quadtree));
+    float half = hpsQuadtreeSize * 0.5;
+    tree->pool = hpsMakePool(sizeof(Quad), hpsQuadtreePoolSize, "Quadtree pool");
+    tree->axis = hpsQuadtreeAxis;
+    if (tree->axis > Z_AXIS){
+        fprintf(stderr, "Quadtree axis must be HPS_X_AXIS, HPS_Y_AXIS, or HPS_Z_AXIS, not %u\n",
+                hpsQuadtreeAxis);
+        tree->axis = Y_AXIS;
+    }
+    tree->u = (tree->axis + 1) % 3;
+    tree->v = (tree->axis + 2) % 3;
+    tree->upMin = INFINITY;
+    tree->upMax = -INFINITY;
+    tree->leafNodes = hpsQuadtreeLeafNodes;
+    tree->root = newQuad(tree, NULL, -half, -half, hpsQuadtreeSize);
+    return tree;
+}
+
+static void freeQuad(Quad *q){
+    hpsDeleteVector(&q->nodes);
+    if (q->spheres != q->spheresData) free(q->spheres);
+}
+
+static void deleteQuad(Quad *q){
+    int i;
+    for (i = 0; i < 4; i++)
+        if (q->children[i]) deleteQuad(q->children[i]);
+    freeQuad(q);
+}
+
+void hpsQuadtreeDelete(Quadtree *tree){
+    deleteQuad(tree->root);
+    hpsDeletePool(tree->pool);
+    free(tree);
+}
+
+/* Whether a node belongs in q, or in one of its children if child is true */
+static bool fits(Quad *q, BoundingSphere *bs, bool child){
+    Quadtree *tree = q->tree;
+    float *c = (float *) bs;
+    float size = child ? q->size * 0.5 : q->size;
+    if (child && q->depth == MAX_DEPTH) return false;
+    return (bs->r <= size * 0.5 &&
+            c[tree->u] >= q->u && c[tree->u] < q->u + q->size &&
+            c[tree->v] >= q->v && c[tree->v] < q->v + q->size);
+}
+
+static Quad *childFor(Quad *q, BoundingSphere *bs){
+    Quadtree *tree = q->tree;
+    float *c = (float *) bs;
+    float half = q->size * 0.5;
+    int right = c[tree->u] >= q->u + half, top = c[tree->v] >= q->v + half;
+    int i = right | (top << 1);
+    if (!q->children[i]){
+        q->children[i] = newQuad(tree, q, q->u + right * half, q->v + top * half, half);
+        q->nChildren++;
+    }
+    return q->children[i];
+}
+
+static void growDistance(Quad *q, float maxDistance){
+    for (; q && q->maxDistance < maxDistance; q = q->parent)
+        q->maxDistance = maxDistance;
+}
+
+static void pushNode(Quad *q, Node *node){
+    hpsPush(&q->nodes, node);
+    if (q->nodes.capacity > q->sphereCapacity){
+        BoundingSphere *spheres = malloc(q->nodes.capacity * sizeof(BoundingSphere));
+        memcpy(spheres, q->spheres, (q->nodes.size - 1) * sizeof(BoundingSphere));
+        if (q->spheres != q->spheresData) free(q->spheres);
+        q->spheres = spheres;
+        q->sphereCapacity = q->nodes.capacity;
+    }
+    q->spheres[q->nodes.size - 1] = *node->boundingSphere;
+    node->slot = q->nodes.size - 1;
+    q->nearestMaxDistance = fminf(q->nearestMaxDistance, node->maxDistance);
+}
+
+static void insert(Node *node, Quad *q);
+
+/* The nodes that fit in the new quads are passed down to them */
+static void splitQuad(Quad *q){
+    HPSvector *v = &q->nodes;
+    int i, j;
+    q->split = true;
+    for (i = 0, j = 0; i < v->size; i++){
+        Node *node = v->data[i];
+        if (fits(q, node->boundingSphere, true))
+            insert(node, childFor(q, node->boundingSphere));
+        else {
+            v->data[j] = node;
+            node->slot = j;
+            q->spheres[j++] = *node->boundingSphere;
+        }
+    }
+    v->size = j;
+}
+
+static void insert(Node *node, Quad *q){
+    BoundingSphere *bs = node->boundingSphere;
+    Quadtree *tree = q->tree;
+    float up = ((float *) bs)[tree->axis];
+    while (q->split && fits(q, bs, true))
+        q = childFor(q, bs);
+    pushNode(q, node);
+    node->area = q;
+    growDistance(q, node->maxDistance);
+    tree->upMin = fminf(tree->upMin, up - bs->r);
+    tree->upMax = fmaxf(tree->upMax, up + bs->r);
+    if (!q->split && q->nodes.size > tree->leafNodes && q->depth < MAX_DEPTH)
+        splitQuad(q);
+}
+
+void hpsQuadtreeAddNode(Node *node, Quadtree *tree){
+    insert(node, tree->root);
+}
+
+static void maybeKillQuad(Quad *q){
+    while (q->parent && !q->nodes.size && !q->nChildren){
+        Quad *parent = q->parent;
+        int i;
+        for (i = 0; parent->children[i] != q; i++);
+        parent->children[i] = NULL;
+        if (!--parent->nChildren && parent->nodes.size <= q->tree->leafNodes)
+            parent->split = false;
+        freeQuad(q);
+        hpsDeleteFrom(q, q->tree->pool);
+        q = parent;
+    }
+}
+
+/* A node's slot is its index in its quad's nodes */
+static int nodeIndex(Quad *q, Node *node){
+    if (node->slot < q->nodes.size && q->nodes.data[node->slot] == node)
+        return node->slot;
+    return -1;
+}
+
+/* The order of a quad's nodes does not matter, so the last takes the place of the removed node */
+static bool removeNode(Node *node, Quad *q){
+    HPSvector *v = &q->nodes;
+    int i = nodeIndex(q, node);
+    if (i < 0) return false;
+    v->data[i] = v->data[--v->size];
+    ((Node *) v->data[i])->slot = i;
+    q->spheres[i] = q->spheres[v->size];
+    return true;
+}
+
+void hpsQuadtreeRemoveNode(Node *node){
+    Quad *q = node->area;
+    if (!removeNode(node, q)){
+        fprintf(stderr, "Warning, tried to remove node %p from a quad that it did not belong to\n", node->data);
+        return;
+    }
+    maybeKillQuad(q);
+}
+
+/* A node stays in its quad for as long as it fits there and not in a child, otherwise it is inserted again from the first quad up that it fits in */
+void hpsQuadtreeUpdateNode(Node *node){
+    Quad *q = node->area, *p = q;
+    BoundingSphere *bs = node->boundingSphere;
+    Quadtree *tree = q->tree;
+    float up = ((float *) bs)[tree->axis];
+    tree->upMin = fminf(tree->upMin, up - bs->r);
+    tree->upMax = fmaxf(tree->upMax, up + bs->r);
+    if (!q->parent || fits(q, bs, false)){
+        if (!q->split || !fits(q, bs, true)){
+            growDistance(q, node->maxDistance);
+            q->nearestMaxDistance = fminf(q->nearestMaxDistance, node->maxDistance);
+            q->spheres[node->slot] = *bs;
+            return;
+        }
+    } else {
+        for (p = q->parent; p->parent && !fits(p, bs, false); p = p->parent);
+    }
+    removeNode(node, q);
+    insert(node, p);
+    maybeKillQuad(q);
+}
+
+/* Visibility testing */
+/* False if none of the quads can be visible */
+static bool groundLines(Quadtree *tree, View *view, Line *lines, int *planeMask){
+    int i;
+    for (i = 0; i < 6; i++){
+        float *p = (float *) &view->planes[i];
+        float a = p[tree->axis] * tree->upMin, b = p[tree->axis] * tree->upMax;
+        Line *l = &lines[i];
+        l->a = p[tree->u];
+        l->b = p[tree->v];
+        l->high = p[3] + fmaxf(a, b);
+        l->low = p[3] + fminf(a, b);
+        // A plane that is level with the ground is either crossed by everything or nothing
+        if (l->a == 0 && l->b == 0){
+            if (l->low >= 0) *planeMask &= ~(1 << i);
+            else if (l->high < 0) return false;
+        }
+    }
+    return true;
+}
+
+/* -1 if a quad is outside of one of the lines, 1 if it is inside them all, otherwise 0, with the lines it crosses added to outMask */
+static int quadInLines(Line *lines, float *min, float *max, int planeMask, int *outMask){
+    int i, result = 1;
+    for (i = 0; i < 6; i++){
+        Line *l = &lines[i];
+        if (!(planeMask & (1 << i))) continue;
+        float pu = (l->a < 0) ? min[0] : max[0], nu = (l->a < 0) ? max[0] : min[0];
+        float pv = (l->b < 0) ? min[1] : max[1], nv = (l->b < 0) ? max[1] : min[1];
+        if (l->a * pu + l->b * pv + l->high < 0) return -1;
+        if (l->a * nu + l->b * nv + l->low < 0){
+            *outMask |= 1 << i;
+            result = 0;
+        }
+    }
+    return result;
+}
+
+static void mapQuad(Quad *q, View *view, void (*func)(Node *), int planeMask){
+    Node **nodes = (Node **) q->nodes.data;
+    bool limited = view->minSize > 0 || q->nearestMaxDistance < INFINITY;
+    int i;
+    for (i = 0; i < q->nodes.size; i++){
+        BoundingSphere *bs = &q->spheres[i];
+        if (hpsSphereInPlanes(view, bs->x, bs->y, bs->z, bs->r, planeMask) &&
+            (!limited ||
+             hpsSphereInRange(view, bs->x, bs->y, bs->z, bs->r, nodes[i]->maxDistance)))
+            func(nodes[i]);
+    }
+}
+
+static void doVisible(Quad *q, View *view, Line *lines, void (*func)(Node *),
+                      int planeMask){
+    Quadtree *tree = q->tree;
+    float half = q->size * 0.5;
+    float min[2] = {q->u - half, q->v - half}, max[2] = {q->u + q->size + half, q->v + q->size + half};
+    float boxMin[3], boxMax[3];
+    int nextMask = 0;
+    int i;
+    boxMin[tree->u] = min[0]; boxMin[tree->v] = min[1]; boxMin[tree->axis] = tree->upMin;
+    boxMax[tree->u] = max[0]; boxMax[tree->v] = max[1]; boxMax[tree->axis] = tree->upMax;
+    if (!hpsBoxInRange(view, boxMin, boxMax, half, q->maxDistance) ||
+        quadInLines(lines, min, max, planeMask, &nextMask) < 0)
+        return;
+    mapQuad(q, view, func, nextMask);
+    for (i = 0; i < 4; i++)
+        if (q->children[i])
+            doVisible(q->children[i], view, lines, func, nextMask);
+}
+
+/* The root may hold nodes that are outside of its bounds, so it is never culled as a whole */
+void hpsQuadtreeDoVisible(Quadtree *tree, View *view, void (*func)(Node *)){
+    Quad *root = tree->root;
+    Line lines[6];
+    int planeMask = ALL_PLANES;
+    int i;
+    mapQuad(root, view, func, ALL_PLANES);
+    if (!groundLines(tree, view, lines, &planeMask)) return;
+    for (i = 0; i < 4; i++)
+        if (root->children[i])
+            doVisible(root->children[i], view, lines, func, planeMask);
+}
@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include "scene.h"
+
+/*
+  Delta format (version 2), all multi-byte fixed-width values little-endian:
+    'H' 'D' version            3 bytes
+    node count                 4 bytes
+    per node:
+      network ID               varint
+      flags                    1 byte: DELTA_POSITION | DELTA_ROTATION
+      position                 3 zigzag varints: quantized position
+      rotation                 4 bytes: smallest-three quaternion
+  Which nodes are written depends on the baseline, but what is written for them does not: positions and rotations are absolute, so applying a delta twice, or after missing one, leaves no error behind.
+ */
+
+#define DELTA_VERSION 2
+#define DELTA_POSITION 1
+#define DELTA_ROTATION 2
+#define QUAT_BITS 10
+#define QUAT_MAX ((1 << QUAT_BITS) - 1)
+
+float hpsReplicationPrecision = 1.0 / 1024.0;
+
+typedef struct {
+    unsigned char *data;
+    size_t size, length;
+} Writer;
+
+typedef struct {
+    const unsigned char *data;
+    size_t size, position;
+} Reader;
+
+void hpsSetNodeNetworkID(HPSnode *node, unsigned int id){
+    node->cold->networkID = id;
+}
+
+unsigned int hpsNodeNetworkID(HPSnode *node){
+    return node->cold->networkID;
+}
+
+/* Writing */
+static void writeByte(Writer *w, unsigned char b){
+    if (w->length < w->size) w->data[w->length] = b;
+    w->length++;
+}
+
+static void writeUint32(Writer *w, uint32_t n){
+    writeByte(w, n); writeByte(w, n >> 8); writeByte(w, n >> 16); writeByte(w, n >> 24);
+}
+
+static void writeVarint(Writer *w, uint32_t n){
+    while (n >= 0x80){
+        writeByte(w, (n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    writeByte(w, n);
+}
+
+static void writeZigzag(Writer *w, int32_t n){
+    writeVarint(w, ((uint32_t) n << 1) ^ (uint32_t) (n >> 31));
+}
+
+/* Reading */
+static bool readByte(Reader *r, unsigned char *b){
+    if (r->position >= r->size) return false;
+    *b = r->data[r->position++];
+    return true;
+}
+
+static bool readUint32(Reader *r, uint32_t *n){
+    unsigned char b[4];
+    if (!readByte(r, &b[0]) || !readByte(r, &b[1]) ||
+        !readByte(r, &b[2]) || !readByte(r, &b[3])) return false;
+    *n = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+    return true;
+}
+
+static bool readVarint(Reader *r, uint32_t *n){
+    unsigned char b;
+    int shift;
+    *n = 0;
+    for (shift = 0; shift < 35; shift += 7){
+        if (!readByte(r, &b)) return false;
+        *n |= (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static bool readZigzag(Reader *r, int32_t *n){
+    uint32_t z;
+    if (!readVarint(r, &z)) return false;
+    *n = (int32_t) (z >> 1) ^ -(int32_t) (z & 1);
+    return true;
+}
+
+/* Quantization. Positions too far out to fit in 32 bits are clamped */
+static int32_t quantize(float x){
+    double q = (double) x / hpsReplicationPrecision;
+    return lrint(fmin(fmax(q, -INT32_MAX), INT32_MAX));
+}
+
+static uint32_t packQuat(HPMquat *quat){
+    float q[4] = {quat->x, quat->y, quat->z, quat->w};
+    int i, largest = 0;
+    uint32_t packed;
+    for (i = 1; i < 4; i++)
+        if (fabsf(q[i]) > fabsf(q[largest])) largest = i;
+    float sign = (q[largest] < 0) ? -1.0 : 1.0;
+    packed = largest;
+    for (i = 0; i < 4; i++){
+        if (i == largest) continue;
+        float c = (sign * q[i] * M_SQRT1_2 + 0.5) * QUAT_MAX;
+        packed = (packed << QUAT_BITS) | (uint32_t) lrintf(fminf(fmaxf(c, 0), QUAT_MAX));
+    }
+    return packed;
+}
+
+static void unpackQuat(uint32_t packed, float *q){
+    int i, largest = packed >> (3 * QUAT_BITS);
+    float sum = 0;
+    for (i = 3; i >= 0; i--){
+        if (i == largest) continue;
+        float c = ((float) (packed & QUAT_MAX) / QUAT_MAX - 0.5) * M_SQRT2;
+        q[i] = c;
+        sum += c * c;
+        packed >>= QUAT_BITS;
+    }
+    q[largest] = sqrtf(fmaxf(1.0 - sum, 0));
+}
+
+/* Encoding */
+static void encodeNode(Writer *w, HPSnode *node, HPMpoint *position, HPMquat *rotation,
+                       unsigned int *count){
+    NodeCold *cold = node->cold;
+    int32_t x = quantize(cold->position.x);
+    int32_t y = quantize(cold->position.y);
+    int32_t z = quantize(cold->position.z);
+    unsigned char flags = 0;
+    if (x != quantize(position->x) || y != quantize(position->y) || z != quantize(position->z))
+        flags |= DELTA_POSITION;
+    if (cold->rotation.x != rotation->x || cold->rotation.y != rotation->y ||
+        cold->rotation.z != rotation->z || cold->rotation.w != rotation->w)
+        flags |= DELTA_ROTATION;
+    if (!flags) return;
+    writeVarint(w, cold->networkID);
+    writeByte(w, flags);
+    if (flags & DELTA_POSITION){
+        writeZigzag(w, x);
+        writeZigzag(w, y);
+        writeZigzag(w, z);
+    }
+    if (flags & DELTA_ROTATION)
+        writeUint32(w, packQuat(&cold->rotation));
+    (*count)++;
+}
+
+/* Every node that changed since the baseline appears either in the records of the baseline or a newer snapshot, or in the scene's changedNodes. The first place a node appears holds its state as of the baseline. */
+size_t hpsEncodeSceneDelta(HPSscene *scene, HPSsnapshot *baseline,
+                           unsigned char *buffer, size_t size){
+    Writer w = {buffer, size, 0};
+    unsigned int mark = ++scene->deltaMark;
+    unsigned int count = 0;
+    HPSsnapshot *s;
+    int i;
+    if (baseline->scene != scene){
+        fprintf(stderr, "Snapshot %p was not taken of scene %p\n", baseline, scene);
+        return 0;
+    }
+    writeByte(&w, 'H');
+    writeByte(&w, 'D');
+    writeByte(&w, DELTA_VERSION);
+    writeUint32(&w, 0);
+    for (s = baseline; s; s = s->newer){
+        for (i = 0; i < s->nRecords; i++){
+            SnapshotRecord *r = &s->records[i];
+            HPSnode *node = r->node;
+            if (!node || !node->cold->networkID || node->cold->deltaMark == mark) continue;
+            node->cold->deltaMark = mark;
+            encodeNode(&w, node, &r->position, &r->rotation, &count);
+        }
+    }
+    for (i = 0; i < scene->changedNodes.size; i++){
+        HPSnode *node = scene->changedNodes.data[i];
+        if (!node->cold->networkID || node->cold->deltaMark == mark) continue;
+        node->cold->deltaMark = mark;
+        encodeNode(&w, node, &node->cold->savedPosition, &node->cold->savedRotation, &count);
+    }
+    if (w.length <= size){
+        Writer header = {buffer + 3, 4, 0};
+        writeUint32(&header, count);
+    }
+    return w.length;
+}
+
+/* Decoding */
+bool hpsApplySceneDelta(const unsigned char *buffer, size_t size,
+                        HPSnode *(*lookup)(unsigned int, void *), void *data){
+    Reader r = {buffer, size, 0};
+    unsigned char h, d, version, flags;
+    uint32_t count, id, packed = 0;
+    int32_t x = 0, y = 0, z = 0;
+    unsigned int i;
+    if (!readByte(&r, &h) || !readByte(&r, &d) || !readByte(&r, &version) ||
+        h != 'H' || d != 'D' || version != DELTA_VERSION || !readUint32(&r, &count)){
+        fprintf(stderr, "Not a scene delta, or an unsupported version\n");
+        return false;
+    }
+    for (i = 0; i < count; i++){
+        if (!readVarint(&r, &id) || !readByte(&r, &flags)) goto truncated;
+        if (flags & DELTA_POSITION)
+            if (!readZigzag(&r, &x) || !readZigzag(&r, &y) || !readZigzag(&r, &z))
+                goto truncated;
+        if (flags & DELTA_ROTATION)
+            if (!readUint32(&r, &packed)) goto truncated;
+        HPSnode *node = lookup(id, data);
+        if (!node) continue;
+        if (flags & DELTA_POSITION){
+            float p[3] = {x * hpsReplicationPrecision,
+                          y * hpsReplicationPrecision,
+                          z * hpsReplicationPrecision};
+            hpsSetNodePosition(node, p);
+        }
+        if (flags & DELTA_ROTATION){
+            unpackQuat(packed, (float *) &node->cold->rotation);
+            hpsNodeNeedsUpdate(node);
+        }
+    }
+    return true;
+truncated:
+    fprintf(stderr, "Scene delta is truncated\n");
+    return false;
+}
@@ -1,12 +1,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include "scene.h"
 
 unsigned int hpsNodePoolSize = 4096;
 
 HPSpartitionInterface *hpsPartitionInterface;
 
+unsigned int hpsPartitionMaintenanceBudget = 65536;
+
 static HPSvector activeScenes, freeScenes;
 
 void hpsInit(){
@@ -19,7 +22,14 @@ void hpsInit(){
 /* Nodes */
 static void freeNode(HPSnode *node, HPSscene *scene){
     int i;
-    if (node->delete) node->delete(node->data);
+    if (node->cold->delete) node->cold->delete(node->data);
+    if (node->isPrefab){
+        free(node->cold->prefabOverrides);
+        node->cold->prefab->nInstances--;
+    }
+    free(node->cold->lods);
+    if (node->isSkeleton) free(node->cold->skeleton);
+    if (node->isHLOD) free(node->cold->hlod);
     if (node->children.capacity){
 	HPSvector *v = &node->children;
 	for (i = 0; i < v->size; i++)
@@ -28,36 +38,103 @@ static void freeNode(HPSnode *node, HPSscene *scene){
     }
 }
 
-static void updateNode(HPSnode *node, HPSscene *scene){
+static void pushChangedSlot(HPSscene *scene, unsigned int slot){
+    if (scene->nChangedSlots == scene->changedSlotsCapacity){
+        scene->changedSlotsCapacity = scene->changedSlotsCapacity ?
+            scene->changedSlotsCapacity * 2 : 256;
+        scene->changedSlots = realloc(scene->changedSlots,
+                                      scene->changedSlotsCapacity * sizeof(unsigned int));
+    }
+    scene->changedSlots[scene->nChangedSlots++] = slot;
+}
+
+static unsigned int distanceRate(HPSnode *node, HPSscene *scene){
+    HPScamera *camera = scene->rateCamera;
+    BoundingSphere *bs = node->partitionData.boundingSphere;
     int i;
-    if (node->needsUpdate){
-        if ((HPSscene *) node->parent == scene){
-            hpmQuaternionRotation((float *) &node->rotation, node->transform);
-            hpmTranslate((float *) &node->position, node->transform);
-        } else {
-            float trans[16];
-            hpmQuaternionRotation((float *) &node->rotation, trans);
-            hpmTranslate((float *) &node->position, trans);
-            hpmMultMat4(trans, node->parent->transform, node->transform);
-        }
-        BoundingSphere *bs = node->partitionData.boundingSphere;
+    if (!camera) return HPS_UPDATE_EVERY_FRAME;
+    float dx = bs->x - camera->position.x;
+    float dy = bs->y - camera->position.y;
+    float dz = bs->z - camera->position.z;
+    float d = dx*dx + dy*dy + dz*dz;
+    for (i = 2; i >= 0; i--)
+        if (d > scene->rateDistances[i]) return i + 1;
+    return HPS_UPDATE_EVERY_FRAME;
+}
+
+/* Throttled subtrees are staggered by phase, so that they don't all update on the same frame */
+static bool updateDue(HPSnode *node, HPSscene *scene){
+    unsigned int rate = node->updateRate;
+    if (node->forceUpdate) return true;
+    if (rate == HPS_UPDATE_BY_DISTANCE) rate = distanceRate(node, scene);
+    unsigned int period = 1 << rate;
+    return ((scene->frame + node->updatePhase) & (period - 1)) == 0;
+}
+
+static void updateNode(HPSnode *node, HPSscene *scene);
+
+/* Bring everything that depends on the node's transform up to date, including its children */
+void hpsTransformChanged(HPSnode *node){
+    HPSscene *scene = node->scene;
+    int i;
+    BoundingSphere *bs = node->partitionData.boundingSphere;
+    if (node->isPrefab){
+        *bs = node->cold->prefab->bounds;
+    } else if (node->isSkeleton){
+        *bs = node->cold->skeleton->bounds;
+    } else {
         bs->x = 0;
         bs->y = 0;
         bs->z = 0;
-        hpmMat4VecMult(node->transform, (float*) bs);
-        if (node->extension){
-            hpsUpdateExtensionNode(node);
-        }
-	scene->partitionInterface->updateNode(&node->partitionData);
-        for (i = 0; i < node->children.size; i++){
-            HPSnode *child = node->children.data[i];
-            child->needsUpdate = true;
-            updateNode(child, scene);
-        }
-        node->needsUpdate = false;
+    }
+    hpmMat4VecMult(node->transform, (float*) bs);
+    if (node->hasExtension){
+        hpsUpdateExtensionNode(node);
+    }
+    scene->partitionInterface->updateNode(&node->partitionData);
+    pushChangedSlot(scene, node->slot);
+    for (i = 0; i < node->children.size; i++){
+        HPSnode *child = node->children.data[i];
+        child->needsUpdate = true;
+        updateNode(child, scene);
+    }
+}
+
+/* Recompute the node's transform from its position, rotation, and parent */
+void hpsComputeNodeTransform(HPSnode *node){
+    if ((HPSscene *) node->parent == node->scene){
+        hpmQuaternionRotation((float *) &node->cold->rotation, node->transform);
+        hpmTranslate((float *) &node->cold->position, node->transform);
+    } else {
+        float trans[16];
+        hpmQuaternionRotation((float *) &node->cold->rotation, trans);
+        hpmTranslate((float *) &node->cold->position, trans);
+        hpmMultMat4(trans, node->parent->transform, node->transform);
+    }
+    if (node->isSkeleton)
+        hpsPoseSkeleton(node->cold->skeleton);
+    node->needsUpdate = false;
+}
+
+void hpsUpdateChildren(HPSnode *node){
+    int i;
+    for (i = 0; i < node->children.size; i++)
+        updateNode(node->children.data[i], node->scene);
+}
+
+/* Nodes with look-at and follow constraints are left for hpsSolveConstraints, along with their subtrees, so that they are only brought up to date once their targets are */
+static void updateNode(HPSnode *node, HPSscene *scene){
+    if (node->updateRate){
+        if (!updateDue(node, scene)) return;
+        node->forceUpdate = false;
+    }
+    if (node->constraint == HPS_CONSTRAINT_LOOK_AT || node->constraint == HPS_CONSTRAINT_FOLLOW){
+        node->constraintReached = true;
+    } else if (node->needsUpdate){
+        hpsComputeNodeTransform(node);
+        hpsTransformChanged(node);
     } else {
-        for (i = 0; i < node->children.size; i++)
-            updateNode(node->children.data[i], scene);
+        hpsUpdateChildren(node);
     }
 }
 
@@ -69,57 +146,238 @@ static void initBoundingSphere(BoundingSphere *bs){
 HPSscene *hpsGetScene(HPSnode *node){
     if (!node->parent)
         return (HPSscene *) node;
-    return hpsGetScene(node->parent);
+    return node->scene;
 }
 
-HPSnode *hpsAddNode(HPSnode *parent, void *data,
+static void nodeChanged(HPSnode *node){
+    node->needsUpdate = true;
+    if (node->scene->newestSnapshot && !node->cold->changedSinceSnapshot){
+        node->cold->changedSinceSnapshot = true;
+        hpsPush(&node->scene->changedNodes, node);
+    }
+}
+
+/* New nodes in a throttled subtree must still be updated before they are rendered */
+static void forceAncestorUpdates(HPSnode *node, HPSscene *scene){
+    for (; (HPSscene *) node != scene; node = node->parent)
+        if (node->updateRate) node->forceUpdate = true;
+}
+
+/* Create a node that has not yet been added to the scene's partition */
+HPSnode *hpsNewNode(HPSnode *parent, void *data,
                     HPSpipeline *pipeline,
                     void (*deleteFunc)(void *)){
     HPSscene *scene = hpsGetScene(parent);
     HPSnode *node = hpsAllocateFrom(scene->nodePool);
+    if (scene->shared) hpsBeginSharedUpdate(scene);
     node->transform = hpsAllocateFrom(scene->transformPool);
+    if (!node->transform){
+        if (scene->shared) hpsEndSharedUpdate(scene);
+        hpsDeleteFrom(node, scene->nodePool);
+        return NULL;
+    }
     node->partitionData.data = node;
-    node->partitionData.boundingSphere = hpsAllocateFrom(scene->boundingSpherePool);
+    node->partitionData.maxDistance = INFINITY;
     hpmIdentityMat4(node->transform);
+    node->partitionData.boundingSphere = scene->shared ?
+        hpsOpenSharedSlot(scene, node->transform) :
+        hpsAllocateFrom(scene->boundingSpherePool);
     initBoundingSphere(node->partitionData.boundingSphere);
-    node->position.x = 0.0; node->position.y = 0.0; node->position.z = 0.0;
-    node->rotation.x = 0.0; node->rotation.y = 0.0; node->rotation.z = 0.0; 
-    node->rotation.w = 1.0;
+    if (scene->shared) hpsEndSharedUpdate(scene);
+    NodeCold *cold = hpsAllocateFrom(scene->coldPool);
+    cold->position.x = 0.0; cold->position.y = 0.0; cold->position.z = 0.0;
+    cold->rotation.x = 0.0; cold->rotation.y = 0.0; cold->rotation.z = 0.0; 
+    cold->rotation.w = 1.0;
+    cold->savedPosition = cold->position;
+    cold->savedRotation = cold->rotation;
+    cold->delete = deleteFunc;
+    cold->networkID = 0;
+    cold->deltaMark = 0;
+    cold->changedSinceSnapshot = false;
+    cold->prefab = NULL;
+    cold->prefabOverrides = NULL;
+    cold->nPrefabOverrides = 0;
+    cold->lods = NULL;
+    node->cold = cold;
     node->data = data;
     node->pipeline = pipeline;
-    node->extension = NULL;
+    cold->extension = NULL;
+    node->hasExtension = false;
     node->parent = parent;
-    node->delete = deleteFunc;
+    node->scene = scene;
+    node->slot = hpsPoolBlockIndex(scene->transformPool, node->transform);
+    node->lastVisible = 0;
+    node->visibleMask = 0;
+    node->updateRate = HPS_UPDATE_EVERY_FRAME;
+    node->updatePhase = 0;
+    node->forceUpdate = false;
     node->needsUpdate = true;
+    node->isPrefab = false;
+    node->constraint = HPS_CONSTRAINT_NONE;
+    node->constraintReached = false;
+    node->isSkeleton = false;
+    node->isHLOD = false;
+    node->queuedForDeletion = false;
+    node->isDeleted = false;
+    node->inCluster = false;
+    node->hasLODs = false;
+    node->lodLevel = 0;
     hpsInitVector(&node->children, 0);
-    scene->partitionInterface->addNode(&node->partitionData, scene->partitionStruct);
-    if ((HPSscene *) parent == scene)
+    if ((HPSscene *) parent == scene){
         hpsPush(&scene->topLevelNodes, node);
-    else
+    } else {
+        node->inCluster = parent->isHLOD || parent->inCluster;
         hpsPush(&parent->children, node);
+        forceAncestorUpdates(parent, scene);
+    }
     return node;
 }
 
-static void deleteNode(HPSnode *node, HPSscene *scene){
-    int i;
-    scene->partitionInterface->removeNode(&node->partitionData);
-    hpsDeleteFrom(node->partitionData.boundingSphere, scene->boundingSpherePool);
-    hpsDeleteFrom(node->transform, scene->transformPool);
-    for (i = 0; i < node->children.size; i++)
-        deleteNode(node->children.data[i], scene);
+HPSnode *hpsAddNode(HPSnode *parent, void *data,
+                    HPSpipeline *pipeline,
+                    void (*deleteFunc)(void *)){
+    HPSnode *node = hpsNewNode(parent, data, pipeline, deleteFunc);
+    if (node)
+        node->scene->partitionInterface->addNode(&node->partitionData,
+                                                 node->scene->partitionStruct);
+    return node;
+}
+
+static void deleteSubtrees(HPSscene *scene, HPSnode **roots, size_t nRoots);
+
+static void detachNode(HPSnode *node, HPSscene *scene){
     if ((HPSscene *) node->parent == scene)
         hpsRemove(&scene->topLevelNodes, node);
     else
         hpsRemove(&node->parent->children, node);
-    freeNode(node, scene);
+}
+
+/* Whether the node, or one of its ancestors, is waiting to be deleted */
+static bool queuedForDeletion(HPSnode *node, HPSscene *scene){
+    for (; node != (HPSnode *) scene; node = node->parent)
+        if (node->queuedForDeletion) return true;
+    return false;
 }
 
 void hpsDeleteNode(HPSnode *node){
-    deleteNode(node, hpsGetScene(node));
+    HPSscene *scene = hpsGetScene(node);
+    if (queuedForDeletion(node, scene)){
+        fprintf(stderr, "Node %p is already queued for deletion\n", node);
+        return;
+    }
+    detachNode(node, scene);
+    deleteSubtrees(scene, &node, 1);
+}
+
+/* Queueing a node that is already going to be deleted does nothing */
+void hpsQueueNodeDeletion(HPSnode *node){
+    HPSscene *scene = hpsGetScene(node);
+    if (queuedForDeletion(node, scene)) return;
+    node->queuedForDeletion = true;
+    detachNode(node, scene);
+    hpsPush(&scene->deleteQueue, node);
+}
+
+/* Deleted nodes have their lastVisible cleared */
+static void removeDeletedNodes(HPSvector *v){
+    int i, j;
+    for (i = 0, j = 0; i < v->size; i++){
+        HPSnode *node = v->data[i];
+        if (node->lastVisible) v->data[j++] = node;
+    }
+    v->size = j;
+}
+
+static void collectSubtree(HPSnode *node, HPSvector *nodes){
+    int i;
+    hpsPush(nodes, &node->partitionData);
+    for (i = 0; i < node->children.size; i++)
+        collectSubtree(node->children.data[i], nodes);
+}
+
+/* Delete the given subtrees at once: the partition gets the whole batch, each pool gets its blocks back in one go, and the scene's lists are each compacted once */
+static void deleteSubtrees(HPSscene *scene, HPSnode **roots, size_t nRoots){
+    HPSvector *nodes = &scene->deletedNodes;
+    HPSvector *blocks = &scene->deletedBlocks;
+    HPSvector *changed = &scene->changedNodes;
+    PartitionInterface *partition = scene->partitionInterface;
+    bool wasChanged = false, wasVisible = false;
+    int i, j;
+    if (scene->shared) hpsBeginSharedUpdate(scene);
+    scene->cullVersion++;
+    for (i = 0; i < nRoots; i++)
+        collectSubtree(roots[i], nodes);
+    if (partition->removeNodes){
+        partition->removeNodes((Node **) nodes->data, nodes->size);
+    } else {
+        for (i = 0; i < nodes->size; i++)
+            partition->removeNode(nodes->data[i]);
+    }
+    for (i = 0; i < nodes->size; i++){
+        HPSnode *node = ((Node *) nodes->data[i])->data;
+        NodeCold *cold = node->cold;
+        if (cold->delete) cold->delete(node->data);
+        hpsDeleteVector(&node->children);
+        if (node->isPrefab){
+            free(cold->prefabOverrides);
+            cold->prefab->nInstances--;
+        }
+        free(cold->lods);
+        if (node->isSkeleton) free(cold->skeleton);
+        if (node->isHLOD) free(cold->hlod);
+        wasChanged |= cold->changedSinceSnapshot;
+        wasVisible |= (node->lastVisible && node->lastVisible + 2 >= scene->frame);
+        cold->changedSinceSnapshot = false;
+        node->isDeleted = true;
+        node->lastVisible = 0;
+        nodes->data[i] = node;
+        hpsPush(blocks, node->transform);
+        if (scene->shared) hpsCloseSharedSlot(scene, node->transform);
+    }
+    if (wasChanged){
+        for (i = 0, j = 0; i < changed->size; i++){
+            HPSnode *node = changed->data[i];
+            if (node->cold->changedSinceSnapshot) changed->data[j++] = node;
+        }
+        changed->size = j;
+    }
+    // Whatever else refers to the deleted nodes lets go of them while they are still allocated
+    if (scene->constrainedNodes.size)
+        hpsRemoveDeletedConstraints(scene);
+    if (scene->newestSnapshot)
+        hpsRemoveDeletedRecords(scene);
+    if (wasVisible){
+        removeDeletedNodes(&scene->visibleNodes);
+        removeDeletedNodes(&scene->previousVisibleNodes);
+        removeDeletedNodes(&scene->hiddenNodes);
+    }
+    hpsDeleteManyFrom(blocks->data, blocks->size, scene->transformPool);
+    if (!scene->shared){
+        for (i = 0; i < nodes->size; i++)
+            blocks->data[i] = ((HPSnode *) nodes->data[i])->partitionData.boundingSphere;
+        hpsDeleteManyFrom(blocks->data, blocks->size, scene->boundingSpherePool);
+    }
+    for (i = 0; i < nodes->size; i++)
+        blocks->data[i] = ((HPSnode *) nodes->data[i])->cold;
+    hpsDeleteManyFrom(blocks->data, blocks->size, scene->coldPool);
+    hpsDeleteManyFrom(nodes->data, nodes->size, scene->nodePool);
+    nodes->size = 0;
+    blocks->size = 0;
+    if (scene->shared) hpsEndSharedUpdate(scene);
+}
+
+static void flushNodeDeletions(HPSscene *scene){
+    HPSvector *queue = &scene->deleteQueue;
+    if (!queue->size) return;
+    deleteSubtrees(scene, (HPSnode **) queue->data, queue->size);
+    queue->size = 0;
 }
 
 void hpsSetNodeBoundingSphere(HPSnode *node, float radius){
+    HPSscene *scene = node->scene;
+    if (scene->shared) hpsBeginSharedUpdate(scene);
     node->partitionData.boundingSphere->r = radius;
+    if (scene->shared) hpsEndSharedUpdate(scene);
     node->needsUpdate = true;
 }
 
@@ -128,29 +386,29 @@ float *hpsNodeBoundingSphere(HPSnode *node){
 }
 
 void hpsMoveNode(HPSnode *node, float *vec){
-    node->position.x += vec[0];
-    node->position.y += vec[1];
-    node->position.z += vec[2];
-    node->needsUpdate = true;
+    node->cold->position.x += vec[0];
+    node->cold->position.y += vec[1];
+    node->cold->position.z += vec[2];
+    nodeChanged(node);
 }
 
 void hpsSetNodePosition(HPSnode *node, float *p){
-    node->position.x = p[0];
-    node->position.y = p[1];
-    node->position.z = p[2];
-    node->needsUpdate = true;
+    node->cold->position.x = p[0];
+    node->cold->position.y = p[1];
+    node->cold->position.z = p[2];
+    nodeChanged(node);
 }
 
 void hpsNodeNeedsUpdate(HPSnode *node){
-    node->needsUpdate = true;
+    nodeChanged(node);
 }
 
 float* hpsNodeRotation(HPSnode *node){
-    return (float *) &node->rotation;
+    return (float *) &node->cold->rotation;
 }
 
 float* hpsNodePosition(HPSnode *node){
-    return (float *) &node->position;
+    return (float *) &node->cold->position;
 }
 
 float* hpsNodeTransform(HPSnode *node){
@@ -161,14 +419,121 @@ void* hpsNodeData(HPSnode *node){
     return node->data;
 }
 
+unsigned int hpsNodeSlot(HPSnode *node){
+    return node->slot;
+}
+
+void hpsSetNodeUpdateRate(HPSnode *node, HPSupdateRate rate){
+    if (rate > HPS_UPDATE_BY_DISTANCE){
+        fprintf(stderr, "Invalid update rate %d\n", rate);
+        return;
+    }
+    node->updateRate = rate;
+    node->updatePhase = node->scene->nextUpdatePhase++;
+}
+
+void hpsSetNodeMaxDistance(HPSnode *node, float distance){
+    node->partitionData.maxDistance = distance;
+    node->scene->partitionInterface->updateNode(&node->partitionData);
+}
+
+static void markCluster(HPSnode *node, bool inCluster){
+    int i;
+    for (i = 0; i < node->children.size; i++){
+        HPSnode *child = node->children.data[i];
+        child->inCluster = inCluster;
+        markCluster(child, inCluster || child->isHLOD);
+    }
+}
+
+void hpsSetNodeHLOD(HPSnode *group, void *data, HPSpipeline *pipeline, float threshold){
+    if (group->isPrefab || group->isSkeleton){
+        fprintf(stderr, "Prefab instances and skeletons can't be HLOD groups\n");
+        return;
+    }
+    if (!pipeline){
+        if (group->isHLOD){
+            free(group->cold->hlod);
+            group->cold->hlod = NULL;
+            group->isHLOD = false;
+            markCluster(group, group->inCluster);
+        }
+        return;
+    }
+    if (!group->isHLOD){
+        group->cold->hlod = malloc(sizeof(HLODGroup));
+        group->cold->hlod->renderPass = 0;
+        group->isHLOD = true;
+        markCluster(group, true);
+    }
+    HLODGroup *hlod = group->cold->hlod;
+    hlod->data = data;
+    hlod->pipeline = pipeline;
+    hlod->threshold = threshold;
+}
+
+#define MAX_LODS 15 // Levels after the node's own, limited by lodLevel
+
+int hpsAddNodeLOD(HPSnode *node, void *data, HPSpipeline *pipeline, float size){
+    NodeLODs *lods = node->cold->lods;
+    unsigned int n = lods ? lods->nLevels : 0;
+    if (n == MAX_LODS){
+        fprintf(stderr, "Node %p already has %d levels of detail\n", node, MAX_LODS);
+        return -1;
+    }
+    if (n && size >= lods->levels[n - 1].size){
+        fprintf(stderr, "Levels of detail must be added from largest to smallest size\n");
+        return -1;
+    }
+    lods = realloc(lods, sizeof(NodeLODs) + (n + 1) * sizeof(LODLevel));
+    lods->levels[n].data = data;
+    lods->levels[n].pipeline = pipeline;
+    lods->levels[n].size = size;
+    lods->nLevels = n + 1;
+    node->cold->lods = lods;
+    node->hasLODs = true;
+    return n + 1;
+}
+
+void hpsClearNodeLODs(HPSnode *node){
+    free(node->cold->lods);
+    node->cold->lods = NULL;
+    node->hasLODs = false;
+    node->lodLevel = 0;
+}
+
+unsigned int hpsNodeLOD(HPSnode *node){
+    return node->lodLevel;
+}
+
+unsigned int hpsNodeLastVisible(HPSnode *node){
+    return node->lastVisible;
+}
+
+unsigned int hpsNodeVisibleMask(HPSnode *node){
+    return node->visibleMask;
+}
+
+/* Called by cameras for every node they see */
+void hpsNodeVisible(HPSnode *node, unsigned int cameraMask){
+    HPSscene *scene = node->scene;
+    if (node->lastVisible != scene->frame){
+        node->lastVisible = scene->frame;
+        node->visibleMask = cameraMask;
+        hpsPush(&scene->visibleNodes, node);
+    } else {
+        node->visibleMask |= cameraMask;
+    }
+}
+
 /* Scenes */
-HPSscene *hpsMakeScene(){
+HPSscene *hpsNewScene(HPSpool transformPool){
     HPSscene *scene = (freeScenes.size) ?
 	hpsPop(&freeScenes) : malloc(sizeof(HPSscene));
     scene->partitionInterface = hpsPartitionInterface;
     scene->nodePool = hpsMakePool(sizeof(HPSnode), hpsNodePoolSize, "Node pool");
-    scene->transformPool = hpsMakePool(sizeof(float) * 16, hpsNodePoolSize,
-				       "Transform pool");
+    scene->coldPool = hpsMakePool(sizeof(NodeCold), hpsNodePoolSize, "Cold node pool");
+    scene->transformPool = transformPool;
     scene->boundingSpherePool = hpsMakePool(sizeof(BoundingSphere),
 					    hpsNodePoolSize,
 					    "Bounding sphere pool");
@@ -176,19 +541,61 @@ HPSscene *hpsMakeScene(){
     scene->null = NULL;
     hpsInitVector(&scene->topLevelNodes, 1024);
     hpsInitVector(&scene->extensions, 4);
+    hpsInitVector(&scene->deleteQueue, 0);
+    hpsInitVector(&scene->deletedNodes, 0);
+    hpsInitVector(&scene->deletedBlocks, 0);
+    hpsInitVector(&scene->changedNodes, 0);
+    hpsInitVector(&scene->constrainedNodes, 0);
+    scene->newestSnapshot = NULL;
+    scene->deltaMark = 0;
+    scene->shared = NULL;
+    scene->sharedWrites = 0;
+    scene->frame = 1;
+    scene->cullVersion = 0;
+    hpsInitVector(&scene->visibleNodes, 0);
+    hpsInitVector(&scene->previousVisibleNodes, 0);
+    hpsInitVector(&scene->hiddenNodes, 0);
+    scene->nextUpdatePhase = 0;
+    scene->changedSlots = NULL;
+    scene->nChangedSlots = 0;
+    scene->changedSlotsCapacity = 0;
+    scene->changedSlotsSorted = true;
+    scene->rateCamera = NULL;
     hpsPush(&activeScenes, (void *) scene);
     return scene;
 }
 
+HPSscene *hpsMakeScene(){
+    return hpsNewScene(hpsMakePool(sizeof(float) * 16, hpsNodePoolSize,
+                                   "Transform pool"));
+}
+
 void hpsDeleteScene(HPSscene *scene){
     int i;
+    flushNodeDeletions(scene);
+    hpsDeleteVector(&scene->deleteQueue);
+    hpsDeleteVector(&scene->deletedNodes);
+    hpsDeleteVector(&scene->deletedBlocks);
+    hpsDeleteSnapshots(scene);
+    hpsDeleteVector(&scene->changedNodes);
+    hpsDeleteVector(&scene->constrainedNodes);
+    hpsDeleteVector(&scene->visibleNodes);
+    hpsDeleteVector(&scene->previousVisibleNodes);
+    hpsDeleteVector(&scene->hiddenNodes);
+    free(scene->changedSlots);
     for (i = 0; i < scene->topLevelNodes.size; i++)
         freeNode(scene->topLevelNodes.data[i], scene);
     scene->partitionInterface->delete(scene->partitionStruct);
     hpsDeleteExtensions(scene);
     hpsClearPool(scene->nodePool);
-    hpsClearPool(scene->transformPool);
+    hpsClearPool(scene->coldPool);
     hpsClearPool(scene->boundingSpherePool);
+    if (scene->shared){
+        hpsBeginSharedUpdate(scene);
+        hpsClearSharedSlots(scene);
+    }
+    hpsClearPool(scene->transformPool);
+    if (scene->shared) hpsEndSharedUpdate(scene);
     hpsRemove(&activeScenes, (void *) scene);
     hpsPush(&freeScenes, (void *) scene);
 }
@@ -202,10 +609,85 @@ void hpsDeactivateScene(HPSscene *s){
     hpsRemove(&activeScenes, (void *) s);
 }
 
+void hpsSetUpdateDistances(HPSscene *scene, HPScamera *camera,
+                           float every2nd, float every4th, float every8th){
+    scene->rateCamera = camera;
+    scene->rateDistances[0] = every2nd * every2nd;
+    scene->rateDistances[1] = every4th * every4th;
+    scene->rateDistances[2] = every8th * every8th;
+}
+
+static int slotOrder(const void *a, const void *b){
+    unsigned int sa = *(unsigned int *) a, sb = *(unsigned int *) b;
+    return (sa > sb) - (sa < sb);
+}
+
+/* Sorted on demand, since not every scene needs them */
+unsigned int *hpsChangedTransforms(HPSscene *scene, unsigned int *n){
+    if (!scene->changedSlotsSorted){
+        unsigned int *slots = scene->changedSlots;
+        size_t i, j;
+        qsort(slots, scene->nChangedSlots, sizeof(unsigned int), slotOrder);
+        // Constrained nodes may have been changed twice
+        for (i = 0, j = 0; i < scene->nChangedSlots; i++)
+            if (!j || slots[j - 1] != slots[i]) slots[j++] = slots[i];
+        scene->nChangedSlots = j;
+        scene->changedSlotsSorted = true;
+    }
+    *n = scene->nChangedSlots;
+    return scene->changedSlots;
+}
+
+float *hpsTransformChunk(HPSscene *scene, unsigned int chunk,
+                         unsigned int *first, unsigned int *n){
+    size_t f, size;
+    float *transforms = hpsPoolChunk(scene->transformPool, chunk, &f, &size);
+    *first = f;
+    *n = size;
+    return transforms;
+}
+
+unsigned int hpsSceneFrame(HPSscene *scene){
+    return scene->frame;
+}
+
+HPSnode **hpsNewlyHiddenNodes(HPSscene *scene, unsigned int *n){
+    *n = scene->hiddenNodes.size;
+    return (HPSnode **) scene->hiddenNodes.data;
+}
+
+/* Nodes seen in the previous frame that weren't seen in this one have just become hidden */
+static void advanceFrame(HPSscene *scene){
+    HPSvector *previous = &scene->previousVisibleNodes;
+    HPSvector *hidden = &scene->hiddenNodes;
+    int i;
+    hidden->size = 0;
+    for (i = 0; i < previous->size; i++){
+        HPSnode *node = previous->data[i];
+        if (node->lastVisible != scene->frame) hpsPush(hidden, node);
+    }
+    HPSvector swap = *previous;
+    *previous = scene->visibleNodes;
+    scene->visibleNodes = swap;
+    scene->visibleNodes.size = 0;
+    scene->frame++;
+}
+
 static void hpsUpdateScene(HPSscene *scene){
     int i;
+    if (scene->shared) hpsBeginSharedUpdate(scene);
+    scene->nChangedSlots = 0;
+    scene->cullVersion++;
+    flushNodeDeletions(scene);
+    advanceFrame(scene);
     for (i = 0; i < scene->topLevelNodes.size; i++)
         updateNode(scene->topLevelNodes.data[i], scene);
+    hpsSolveConstraints(scene);
+    scene->changedSlotsSorted = (scene->nChangedSlots < 2);
+    if (scene->shared) hpsEndSharedUpdate(scene);
+    if (scene->partitionInterface->maintain && hpsPartitionMaintenanceBudget)
+        scene->partitionInterface->maintain(scene->partitionStruct,
+                                            hpsPartitionMaintenanceBudget);
 }
 
 void hpsUpdateScenes(){
@@ -214,6 +696,18 @@ void hpsUpdateScenes(){
 	hpsUpdateScene((HPSscene *) activeScenes.data[i]);
 }
 
+/* The budget is shared by the active scenes, in the order they were activated */
+void hpsMaintainPartitions(unsigned int budget){
+    unsigned int work = 0;
+    int i;
+    for (i = 0; i < activeScenes.size && work < budget; i++){
+        HPSscene *scene = activeScenes.data[i];
+        if (scene->partitionInterface->maintain)
+            work += scene->partitionInterface->maintain(scene->partitionStruct,
+                                                        budget - work);
+    }
+}
+
 
 
 /* Pipelines */
@@ -241,7 +735,8 @@ void hpsSetNodeExtension(HPSnode *node, HPSextension *extension){
     for (i = 0; i < scene->extensions.size; i += 2){
         HPSextension *e = (HPSextension *) scene->extensions.data[i];
         if ((void*) extension == (void*) e){
-            node->extension = &scene->extensions.data[i];
+            node->cold->extension = &scene->extensions.data[i];
+            node->hasExtension = true;
             return;
         }
     }
@@ -293,15 +788,17 @@ void hpsDeleteExtensions(HPSscene *scene){
 }
 
 void *hpsNodeExtensionData(HPSnode *node){
-    return node->extension[1];
+    return node->cold->extension[1];
 }
 
 void hpsVisibleExtensionNode(HPSnode *node){
-    HPSextension *e = (HPSextension *) node->extension[0];
-    e->visibleNode(node->extension[1], node);
+    void **extension = node->cold->extension;
+    HPSextension *e = (HPSextension *) extension[0];
+    e->visibleNode(extension[1], node);
 }
 
 void hpsUpdateExtensionNode(HPSnode *node){
-    HPSextension *e = (HPSextension *) node->extension[0];
-    e->updateNode(node->extension[1], node);
+    void **extension = node->cold->extension;
+    HPSextension *e = (HPSextension *) extension[0];
+    e->updateNode(extension[1], node);
 }
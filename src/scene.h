@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <hypermath.h>
 #include <hyperscene.h>
 #include "memory.h"
@@ -12,28 +13,172 @@ struct pipeline {
     void (*postRender)();
 };
 
+typedef struct {
+    void *data;
+    struct pipeline *pipeline;
+} PrefabOverride;
+
+typedef struct {
+    int parent; // -1 for parts at the root of the prefab
+    void *data;
+    struct pipeline *pipeline;
+    float transform[16]; // Relative to the root of the prefab
+    BoundingSphere boundingSphere; // Relative to the root of the prefab
+} PrefabPart;
+
+struct prefab {
+    PrefabPart *parts;
+    unsigned int nParts, capacity;
+    unsigned int nInstances; // Instances that have not been deleted, the prefab can't be deleted until there are none
+    BoundingSphere bounds; // Contains every part, relative to the root of the prefab
+};
+
+struct skeleton {
+    unsigned int nBones;
+    int *parents; // Index of each bone's parent, which comes before it, or -1
+    float *inverseBindMatrices; // 16 floats per bone
+};
+
+// State of a skeleton node, its arrays following it in the same allocation
+typedef struct {
+    struct skeleton *skeleton;
+    float *bones; // Transform of each bone relative to the node
+    float *palette; // Skinning matrices: bones multiplied by the inverse bind matrices
+    HPMquat *rotations; // Local pose of each bone
+    HPMpoint *positions;
+    float *scales;
+    float radius; // Added to the extent of the bones' origins
+    BoundingSphere bounds; // Relative to the node
+} SkeletonPose;
+
+// Stands in for every node below an HLOD group when the group is small on screen
+typedef struct {
+    void *data;
+    struct pipeline *pipeline;
+    float threshold; // Projected size below which the proxy is rendered
+    unsigned int renderPass; // Render in which collapsed was last decided
+    bool collapsed;
+} HLODGroup;
+
+typedef struct {
+    void *data;
+    struct pipeline *pipeline;
+    float size; // Projected size below which the level is used
+} LODLevel;
+
+// Levels of detail of a node, coarsest last. Level 0 is the node's own data and pipeline
+typedef struct {
+    unsigned int nLevels;
+    LODLevel levels[]; // Level i + 1
+} NodeLODs;
+
+// The node's constraint type is kept with its flags
+typedef struct {
+    struct node *target;
+    HPMpoint vector; // Up for HPS_CONSTRAINT_LOOK_AT, offset for HPS_CONSTRAINT_FOLLOW, axis for HPS_CONSTRAINT_AXIAL_BILLBOARD
+    unsigned int order; // Constraints are solved in increasing order, set while they are being sorted
+} Constraint;
+
+// Node state that is not needed to traverse, cull, or render a node
+typedef struct {
+    HPMpoint position; // Only read when the node needs to be updated
+    HPMquat rotation;
+    HPMpoint savedPosition; // Position and rotation as of the scene's newest snapshot
+    HPMquat savedRotation;
+    void (*delete)(void *); //(data)
+    void **extension; // The extension's entry in the scene's extensions
+    unsigned int networkID, deltaMark;
+    bool changedSinceSnapshot;
+    union {
+        struct {
+            struct prefab *prefab; // NULL unless the node is a prefab instance
+            PrefabOverride *prefabOverrides; // One per part, NULL until a part is overridden
+            unsigned int nPrefabOverrides; // Parts added to the prefab after this are not overridden
+        };
+        SkeletonPose *skeleton; // Set when the node is a skeleton
+        HLODGroup *hlod; // Set when the node is an HLOD group
+    };
+    NodeLODs *lods; // NULL unless the node has levels of detail
+    Constraint constraint;
+} NodeCold;
+
+/* Laid out in two 64-byte cache lines: the first holds what is read to cull a node and queue it, the second what is read while walking the scene to update it and while rendering it */
 struct node {
-    struct node *parent;
+    struct node *parent; // Must come first, see hpsGetScene
     Node partitionData;
-    HPSscene *scene;
-    HPSvector children;
-    HPMpoint position;
-    HPMquat rotation;
-    float *transform;
     struct pipeline *pipeline;
-    void **extension;
-    void (*delete)(void *); //(data)
+    HPSscene *scene;
+
     void *data;
-    bool needsUpdate;
+    float *transform;
+    NodeCold *cold;
+    HPSvector children;
+    unsigned int slot; // Index of the transform in the scene's transform pool
+    unsigned int lastVisible; // Frame the node was last seen by a camera, 0 if never
+    unsigned int visibleMask; // Masks of the cameras that saw the node in that frame
+    unsigned char updateRate : 4; // HPSupdateRate of the node's subtree
+    unsigned char updatePhase : 4; // Offsets the frames on which a throttled subtree is updated
+    bool needsUpdate : 1;
+    bool forceUpdate : 1; // Update the subtree next frame, even if it is throttled
+    bool isPrefab : 1; // The node is an instance of cold->prefab
+    bool isSkeleton : 1; // cold->skeleton is set
+    bool isHLOD : 1; // cold->hlod is set
+    bool inCluster : 1; // The node has an HLOD group as an ancestor
+    bool hasLODs : 1; // cold->lods is set
+    bool hasExtension : 1; // cold->extension is set
+    bool queuedForDeletion : 1; // Set by hpsQueueNodeDeletion, the node goes with the next flush
+    bool isDeleted : 1; // Set while the node is being deleted, so that what refers to it can let go of it before it is freed
+    unsigned char constraint : 3; // HPSconstraint, cold->constraint holds its parameters
+    bool constraintReached : 1; // The update reached the node, and left it for its constraint to be solved
+    unsigned char lodLevel : 4; // Level of detail the node was last rendered at
 };
 
+// Start of a region of shared memory holding a scene's transforms, bounding spheres, and which of their slots are in use
+typedef struct {
+    uint32_t magic, version;
+    uint32_t sequence; // Odd while the scene is being updated
+    uint32_t nSlots;
+    uint64_t size, transformOffset, boundingSphereOffset, liveOffset;
+} SharedSceneHeader;
+
 struct scene {
     void *null; // used to distinguish top-level nodes;
     HPSvector topLevelNodes;
     PartitionInterface *partitionInterface;
     void *partitionStruct;
-    HPSpool nodePool, boundingSpherePool, transformPool, partitionPool;
+    HPSpool nodePool, coldPool, boundingSpherePool, transformPool, partitionPool;
     HPSvector extensions;
+    HPSvector deleteQueue, deletedNodes, deletedBlocks; // Nodes waiting to be deleted, and scratch space for deleting them
+    HPSvector changedNodes; // Nodes whose position or rotation changed since the newest snapshot
+    HPSvector constrainedNodes; // Nodes with constraints that are solved after every update
+    struct snapshot *newestSnapshot;
+    unsigned int deltaMark; // Incremented every time a delta is encoded
+    SharedSceneHeader *shared; // NULL unless the scene lives in shared memory
+    unsigned int sharedWrites; // Writes to shared memory under way, the sequence is odd while there are any
+    unsigned int frame; // Incremented every time the scene is updated
+    unsigned int cullVersion; // Incremented whenever nodes may have moved or been deleted, so that cameras' culled nodes can be told apart from stale ones
+    HPSvector visibleNodes, previousVisibleNodes; // Nodes seen in this frame, and in the previous one
+    HPSvector hiddenNodes; // Nodes seen in the previous frame, but not this one, as of the last update
+    unsigned char nextUpdatePhase;
+    struct camera *rateCamera; // Camera that HPS_UPDATE_BY_DISTANCE nodes are measured from
+    float rateDistances[3]; // Squared distances past which nodes update every 2nd, 4th, and 8th frame
+    unsigned int *changedSlots; // Slots of the transforms recomputed by the last update
+    size_t nChangedSlots, changedSlotsCapacity;
+    bool changedSlotsSorted;
+};
+
+typedef struct {
+    HPSnode *node; // NULL once the node is deleted
+    HPMpoint position;
+    HPMquat rotation;
+} SnapshotRecord;
+
+// Holds the state, as of this snapshot, of every node that changed before the next snapshot was taken
+struct snapshot {
+    HPSscene *scene;
+    struct snapshot *older, *newer;
+    SnapshotRecord *records;
+    size_t nRecords, capacity;
 };
 
 struct camera {
@@ -49,12 +194,48 @@ struct camera {
     float viewProjection[16];
     float modelViewProjection[16];
     Plane planes[6];
+    float minSize; // Projected size below which nodes are culled
+    unsigned int mask; // Bit that identifies the camera in a node's visibleMask
+    bool culled; // Whether visibleNodes holds what the camera sees, from hpsCullCameras
+    unsigned int culledVersion; // The scene's cullVersion when visibleNodes was filled
+    HPSvector visibleNodes;
     cameraUpdateFun update;
     void (*sort)(const HPMpoint*, const HPMpoint*, float *, float*); // used to sort points based on camera positioning
 };
 
 void hpsInitCameras();
 
+/* Scenes */
+HPSscene *hpsNewScene(HPSpool transformPool);
+HPSnode *hpsNewNode(HPSnode *parent, void *data, HPSpipeline *pipeline,
+                    void (*deleteFunc)(void *));
+void hpsNodeVisible(HPSnode *node, unsigned int cameraMask);
+void hpsTransformChanged(HPSnode *node);
+void hpsComputeNodeTransform(HPSnode *node);
+void hpsUpdateChildren(HPSnode *node);
+
+void hpsCameraViewVolume(HPScamera *camera, View *view);
+
+/* Skeletons */
+void hpsPoseSkeleton(SkeletonPose *pose);
+
+/* Constraints */
+void hpsSolveConstraints(HPSscene *scene);
+void hpsRemoveDeletedConstraints(HPSscene *scene);
+
+void hpsRemoveDeletedRecords(HPSscene *scene);
+bool hpsBillboardTransform(HPSnode *node, HPScamera *camera, float *dest);
+
+/* Shared scenes */
+BoundingSphere *hpsOpenSharedSlot(HPSscene *scene, float *transform);
+void hpsCloseSharedSlot(HPSscene *scene, float *transform);
+void hpsClearSharedSlots(HPSscene *scene);
+void hpsBeginSharedUpdate(HPSscene *scene);
+void hpsEndSharedUpdate(HPSscene *scene);
+
+/* Snapshots */
+void hpsDeleteSnapshots(HPSscene *scene);
+
 /* Extensions */
 void hpsPreRenderExtensions(HPSscene *scene);
 void hpsPostRenderExtensions(HPSscene *scene);
@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scene.h"
+
+/*
+  Scene file format (version 2), in native byte order:
+    FileHeader
+    nNodes FileNode records, in depth-first order so that parents come before their children
+    nNodes 4x4 world transforms
+    nNodes (x y z r) world bounding spheres
+
+  Since world transforms and bounding spheres are stored, loaded nodes don't need to be updated before they are added to the scene's partition, which is done all at once.
+
+  Prefab instances, skeletons, nodes with levels of detail, HLOD groups, and constrained nodes hold state that can't be stored in a FileNode, so scenes that have any are not saved.
+ */
+
+#define FILE_MAGIC "HPSB"
+#define FILE_VERSION 2
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t nNodes;
+    uint32_t nodeOffset, transformOffset, boundingSphereOffset;
+} FileHeader;
+
+typedef struct {
+    int32_t parent; // -1 for top-level nodes
+    int32_t pipeline; // Index into the pipeline array, -1 for none
+    int32_t extension; // Index of the scene's extension, -1 for none
+    uint32_t data; // ID of the node's data
+    HPMpoint position;
+    HPMquat rotation;
+    float maxDistance;
+    uint32_t networkID;
+    uint32_t updateRate; // HPSupdateRate
+} FileNode;
+
+typedef struct {
+    FileNode *nodes;
+    float *transforms;
+    BoundingSphere *boundingSpheres;
+    uint32_t nNodes;
+    HPSscene *scene;
+    HPSpipeline **pipelines;
+    unsigned int nPipelines;
+    unsigned int (*dataID)(void *);
+} Saver;
+
+static uint32_t countNodes(HPSnode *node){
+    uint32_t n = 1;
+    int i;
+    for (i = 0; i < node->children.size; i++)
+        n += countNodes(node->children.data[i]);
+    return n;
+}
+
+/* Whether every node of the subtree can be stored in a FileNode */
+static bool canSave(HPSnode *node){
+    int i;
+    if (node->isPrefab || node->isSkeleton || node->hasLODs || node->isHLOD ||
+        node->constraint != HPS_CONSTRAINT_NONE){
+        fprintf(stderr, "Node %p is a prefab instance, skeleton, HLOD group, or has levels of detail or a constraint, which can't be saved\n", node);
+        return false;
+    }
+    for (i = 0; i < node->children.size; i++)
+        if (!canSave(node->children.data[i])) return false;
+    return true;
+}
+
+static int pipelineIndex(Saver *s, HPSpipeline *pipeline){
+    int i;
+    if (!pipeline) return -1;
+    for (i = 0; i < s->nPipelines; i++)
+        if (s->pipelines[i] == pipeline) return i;
+    fprintf(stderr, "Pipeline %p was not given to hpsSaveScene, node saved without it\n", pipeline);
+    return -1;
+}
+
+static void saveNode(Saver *s, HPSnode *node, int32_t parent){
+    uint32_t index = s->nNodes++;
+    FileNode *f = &s->nodes[index];
+    int i;
+    f->parent = parent;
+    f->pipeline = pipelineIndex(s, node->pipeline);
+    f->extension = node->hasExtension ?
+        (node->cold->extension - s->scene->extensions.data) / 2 : -1;
+    f->data = s->dataID ? s->dataID(node->data) : 0;
+    f->position = node->cold->position;
+    f->rotation = node->cold->rotation;
+    f->maxDistance = node->partitionData.maxDistance;
+    f->networkID = node->cold->networkID;
+    f->updateRate = node->updateRate;
+    memcpy(&s->transforms[index * 16], node->transform, sizeof(float) * 16);
+    s->boundingSpheres[index] = *node->partitionData.boundingSphere;
+    for (i = 0; i < node->children.size; i++)
+        saveNode(s, node->children.data[i], index);
+}
+
+bool hpsSaveScene(HPSscene *scene, const char *path,
+                  HPSpipeline **pipelines, unsigned int nPipelines,
+                  unsigned int (*dataID)(void *)){
+    uint32_t nNodes = 0;
+    int i;
+    for (i = 0; i < scene->topLevelNodes.size; i++){
+        if (!canSave(scene->topLevelNodes.data[i])){
+            fprintf(stderr, "Could not save scene to %s\n", path);
+            return false;
+        }
+        nNodes += countNodes(scene->topLevelNodes.data[i]);
+    }
+    Saver s = {malloc(nNodes * sizeof(FileNode)),
+               malloc(nNodes * sizeof(float) * 16),
+               malloc(nNodes * sizeof(BoundingSphere)),
+               0, scene, pipelines, nPipelines, dataID};
+    for (i = 0; i < scene->topLevelNodes.size; i++)
+        saveNode(&s, scene->topLevelNodes.data[i], -1);
+    FileHeader header;
+    memcpy(header.magic, FILE_MAGIC, 4);
+    header.version = FILE_VERSION;
+    header.nNodes = nNodes;
+    header.nodeOffset = sizeof(FileHeader);
+    header.transformOffset = header.nodeOffset + nNodes * sizeof(FileNode);
+    header.boundingSphereOffset = header.transformOffset + nNodes * sizeof(float) * 16;
+    bool success = false;
+    FILE *file = fopen(path, "wb");
+    if (file){
+        success = (fwrite(&header, sizeof(FileHeader), 1, file) == 1 &&
+                   fwrite(s.nodes, sizeof(FileNode), nNodes, file) == nNodes &&
+                   fwrite(s.transforms, sizeof(float) * 16, nNodes, file) == nNodes &&
+                   fwrite(s.boundingSpheres, sizeof(BoundingSphere), nNodes, file) == nNodes);
+        success = (fclose(file) == 0) && success;
+    }
+    if (!success)
+        fprintf(stderr, "Could not write scene to %s\n", path);
+    free(s.nodes);
+    free(s.transforms);
+    free(s.boundingSpheres);
+    return success;
+}
+
+static bool validHeader(FileHeader *header, size_t size){
+    if (size < sizeof(FileHeader) ||
+        memcmp(header->magic, FILE_MAGIC, 4) ||
+        header->version != FILE_VERSION)
+        return false;
+    size_t n = header->nNodes;
+    return (header->nodeOffset + n * sizeof(FileNode) <= size &&
+            header->transformOffset + n * sizeof(float) * 16 <= size &&
+            header->boundingSphereOffset + n * sizeof(BoundingSphere) <= size);
+}
+
+HPSscene *hpsLoadScene(const char *path,
+                       HPSpipeline **pipelines, unsigned int nPipelines,
+                       HPSextension **extensions, unsigned int nExtensions,
+                       void *(*loadData)(unsigned int),
+                       void (*deleteFunc)(void *)){
+    struct stat st;
+    uint32_t i;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0){
+        perror("Could not open scene file");
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED){
+        perror("Could not map scene file");
+        return NULL;
+    }
+    FileHeader *header = (FileHeader *) file;
+    if (!validHeader(header, st.st_size)){
+        fprintf(stderr, "%s is not a scene file, or is an unsupported version\n", path);
+        munmap(file, st.st_size);
+        return NULL;
+    }
+    FileNode *fileNodes = (FileNode *) (file + header->nodeOffset);
+    float *transforms = (float *) (file + header->transformOffset);
+    BoundingSphere *boundingSpheres = (BoundingSphere *) (file + header->boundingSphereOffset);
+    HPSscene *scene = hpsMakeScene();
+    for (i = 0; i < nExtensions; i++)
+        hpsActivateExtension(scene, extensions[i]);
+    HPSnode **nodes = malloc(header->nNodes * sizeof(HPSnode *));
+    Node **partitionNodes = malloc(header->nNodes * sizeof(Node *));
+    uint32_t nNodes = 0;
+    for (i = 0; i < header->nNodes; i++){
+        FileNode *f = &fileNodes[i];
+        if (f->parent >= (int32_t) i || f->pipeline >= (int32_t) nPipelines ||
+            f->extension >= (int32_t) nExtensions || f->updateRate > HPS_UPDATE_BY_DISTANCE){
+            fprintf(stderr, "Node %u of %s is invalid\n", i, path);
+            goto abort;
+        }
+        HPSnode *parent = (f->parent < 0) ? (HPSnode *) scene : nodes[f->parent];
+        void *data = loadData ? loadData(f->data) : NULL;
+        HPSnode *node = hpsNewNode(parent, data,
+                                   (f->pipeline < 0) ? NULL : pipelines[f->pipeline],
+                                   deleteFunc);
+        if (!node){
+            fprintf(stderr, "Could not allocate node %u of %s\n", i, path);
+            if (deleteFunc) deleteFunc(data);
+            goto abort;
+        }
+        NodeCold *cold = node->cold;
+        cold->position = f->position;
+        cold->rotation = f->rotation;
+        cold->savedPosition = f->position;
+        cold->savedRotation = f->rotation;
+        cold->networkID = f->networkID;
+        node->partitionData.maxDistance = f->maxDistance;
+        if (f->updateRate){
+            node->updateRate = f->updateRate;
+            node->updatePhase = scene->nextUpdatePhase++;
+        }
+        memcpy(node->transform, &transforms[i * 16], sizeof(float) * 16);
+        *node->partitionData.boundingSphere = boundingSpheres[i];
+        node->needsUpdate = false;
+        if (f->extension >= 0){
+            node->cold->extension = &scene->extensions.data[f->extension * 2];
+            node->hasExtension = true;
+            node->needsUpdate = true; // Let the extension see the node
+        }
+        nodes[i] = node;
+        partitionNodes[nNodes++] = &node->partitionData;
+    }
+    PartitionInterface *partition = scene->partitionInterface;
+    if (partition->addNodes){
+        partition->addNodes(partitionNodes, nNodes, scene->partitionStruct);
+    } else {
+        for (i = 0; i < nNodes; i++)
+            partition->addNode(partitionNodes[i], scene->partitionStruct);
+    }
+    free(nodes);
+    free(partitionNodes);
+    munmap(file, st.st_size);
+    return scene;
+abort: // Nodes that were loaded are not in the partition yet, and are freed with the scene
+    hpsDeleteScene(scene);
+    free(nodes);
+    free(partitionNodes);
+    munmap(file, st.st_size);
+    return NULL;
+}
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scene.h"
+
+/*
+  Shared scene region layout:
+    SharedSceneHeader
+    Transform pool: pool header followed by nSlots 16 float transforms
+    nSlots (x y z r) bounding spheres
+    nSlots bytes: non-zero if the slot belongs to a node
+
+  The header's sequence is a seqlock: it is odd while the scene is being updated, or while anything else is written to the region, such as a node being created or deleted. Readers must check that it was even and unchanged over the course of their read.
+ */
+
+#define SHARED_MAGIC 0x53535048 // "HPSS"
+#define SHARED_VERSION 1
+#define TRANSFORM_SIZE (sizeof(float) * 16)
+
+static size_t align(size_t n){
+    return (n + 63) & ~((size_t) 63);
+}
+
+static size_t transformPoolSize(unsigned int nSlots){
+    return sizeof(struct pool) + nSlots * TRANSFORM_SIZE;
+}
+
+size_t hpsSharedSceneSize(unsigned int nNodes){
+    return align(sizeof(SharedSceneHeader)) + align(transformPoolSize(nNodes)) +
+        align(nNodes * sizeof(BoundingSphere)) + nNodes;
+}
+
+/* Writer */
+HPSscene *hpsMakeSceneInRegion(void *region, size_t size){
+    SharedSceneHeader *header = (SharedSceneHeader *) region;
+    unsigned int nSlots = size / (TRANSFORM_SIZE + sizeof(BoundingSphere) + 1);
+    while (nSlots && hpsSharedSceneSize(nSlots) > size) nSlots--;
+    if (!nSlots){
+        fprintf(stderr, "Region is too small to hold a scene\n");
+        return NULL;
+    }
+    header->magic = SHARED_MAGIC;
+    header->version = SHARED_VERSION;
+    header->sequence = 0;
+    header->nSlots = nSlots;
+    header->size = size;
+    header->transformOffset = align(sizeof(SharedSceneHeader));
+    header->boundingSphereOffset = header->transformOffset + align(transformPoolSize(nSlots));
+    header->liveOffset = header->boundingSphereOffset + align(nSlots * sizeof(BoundingSphere));
+    memset((char *) region + header->liveOffset, 0, nSlots);
+    HPSpool transformPool = hpsMakePoolIn((char *) region + header->transformOffset,
+                                          transformPoolSize(nSlots), TRANSFORM_SIZE,
+                                          "Shared transform pool");
+    HPSscene *scene = hpsNewScene(transformPool);
+    scene->shared = header;
+    return scene;
+}
+
+BoundingSphere *hpsOpenSharedSlot(HPSscene *scene, float *transform){
+    SharedSceneHeader *header = scene->shared;
+    size_t slot = hpsPoolBlockIndex(scene->transformPool, transform);
+    ((unsigned char *) header + header->liveOffset)[slot] = 1;
+    return (BoundingSphere *) ((char *) header + header->boundingSphereOffset) + slot;
+}
+
+void hpsCloseSharedSlot(HPSscene *scene, float *transform){
+    SharedSceneHeader *header = scene->shared;
+    size_t slot = hpsPoolBlockIndex(scene->transformPool, transform);
+    ((unsigned char *) header + header->liveOffset)[slot] = 0;
+}
+
+void hpsClearSharedSlots(HPSscene *scene){
+    SharedSceneHeader *header = scene->shared;
+    memset((char *) header + header->liveOffset, 0, header->nSlots);
+}
+
+/* Writes may nest, as when nodes are deleted during an update: only the outermost changes the sequence */
+void hpsBeginSharedUpdate(HPSscene *scene){
+    uint32_t *sequence = &scene->shared->sequence;
+    if (scene->sharedWrites++) return;
+    __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void hpsEndSharedUpdate(HPSscene *scene){
+    uint32_t *sequence = &scene->shared->sequence;
+    if (--scene->sharedWrites) return;
+    __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+}
+
+/* POSIX shared memory */
+void *hpsCreateSharedRegion(const char *name, size_t size){
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+    if (fd < 0){
+        perror("Could not create shared memory region");
+        return NULL;
+    }
+    if (ftruncate(fd, size) < 0){
+        perror("Could not size shared memory region");
+        close(fd);
+        return NULL;
+    }
+    void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED){
+        perror("Could not map shared memory region");
+        return NULL;
+    }
+    return region;
+}
+
+void hpsDeleteSharedRegion(const char *name, void *region, size_t size){
+    munmap(region, size);
+    shm_unlink(name);
+}
+
+/* Reader */
+HPSsharedScene *hpsOpenSharedScene(const char *name){
+    struct stat st;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0){
+        perror("Could not open shared memory region");
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(SharedSceneHeader)){
+        fprintf(stderr, "Shared memory region %s does not hold a scene\n", name);
+        close(fd);
+        return NULL;
+    }
+    void *region = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED){
+        perror("Could not map shared memory region");
+        return NULL;
+    }
+    SharedSceneHeader *header = (SharedSceneHeader *) region;
+    if (header->magic != SHARED_MAGIC || header->version != SHARED_VERSION ||
+        header->size != st.st_size){
+        fprintf(stderr, "Shared memory region %s does not hold a scene\n", name);
+        munmap(region, st.st_size);
+        return NULL;
+    }
+    return (HPSsharedScene *) header;
+}
+
+void hpsCloseSharedScene(HPSsharedScene *scene){
+    SharedSceneHeader *header = (SharedSceneHeader *) scene;
+    munmap(header, header->size);
+}
+
+unsigned int hpsSharedSceneReadBegin(HPSsharedScene *scene){
+    SharedSceneHeader *header = (SharedSceneHeader *) scene;
+    uint32_t sequence;
+    while ((sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE)) & 1);
+    return sequence;
+}
+
+bool hpsSharedSceneReadValid(HPSsharedScene *scene, unsigned int sequence){
+    SharedSceneHeader *header = (SharedSceneHeader *) scene;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&header->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+unsigned int hpsSharedSceneSlots(HPSsharedScene *scene){
+    return ((SharedSceneHeader *) scene)->nSlots;
+}
+
+float *hpsSharedSceneTransforms(HPSsharedScene *scene){
+    SharedSceneHeader *header = (SharedSceneHeader *) scene;
+    return (float *) ((char *) header + header->transformOffset + sizeof(struct pool));
+}
+
+float *hpsSharedSceneBoundingSpheres(HPSsharedScene *scene){
+    SharedSceneHeader *header = (SharedSceneHeader *) scene;
+    return (float *) ((char *) header + header->boundingSphereOffset);
+}
+
+unsigned char *hpsSharedSceneLiveSlots(HPSsharedScene *scene){
+    SharedSceneHeader *header = (SharedSceneHeader *) scene;
+    return (unsigned char *) header + header->liveOffset;
+}
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "scene.h"
+
+/*
+  A skeleton is a single node whose bones are kept in flat arrays, ordered so that every bone comes after its parent. Bones are posed by their local position, rotation, and scale. When the node is updated, the bones' transforms relative to the node are computed in one pass over those arrays, followed by the palette of skinning matrices: each bone's transform multiplied by its inverse bind matrix. The palette is contiguous so that it can be uploaded as is. Unlike nodes, a bone's transform is its parent's transform multiplied by its local transform, as is expected of skinning matrices.
+ */
+
+HPSskeleton *hpsMakeSkeleton(unsigned int nBones, int *parents, float *inverseBindMatrices){
+    unsigned int i;
+    for (i = 0; i < nBones; i++)
+        if (parents[i] >= (int) i){
+            fprintf(stderr, "Bone %u of skeleton must come after its parent %d\n", i, parents[i]);
+            return NULL;
+        }
+    HPSskeleton *skeleton = malloc(sizeof(HPSskeleton));
+    skeleton->nBones = nBones;
+    skeleton->parents = malloc(nBones * sizeof(int));
+    memcpy(skeleton->parents, parents, nBones * sizeof(int));
+    skeleton->inverseBindMatrices = malloc(nBones * sizeof(float) * 16);
+    if (inverseBindMatrices){
+        memcpy(skeleton->inverseBindMatrices, inverseBindMatrices, nBones * sizeof(float) * 16);
+    } else {
+        for (i = 0; i < nBones; i++)
+            hpmIdentityMat4(&skeleton->inverseBindMatrices[i * 16]);
+    }
+    return skeleton;
+}
+
+void hpsDeleteSkeleton(HPSskeleton *skeleton){
+    free(skeleton->parents);
+    free(skeleton->inverseBindMatrices);
+    free(skeleton);
+}
+
+/* The pose and every array it points to are a single allocation, with the matrices aligned to cache lines */
+static SkeletonPose *newPose(HPSskeleton *skeleton, float radius){
+    size_t n = skeleton->nBones;
+    size_t matrices = (sizeof(SkeletonPose) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    size_t size = matrices + 2 * n * sizeof(float) * 16 +
+        n * (sizeof(HPMpoint) + sizeof(HPMquat) + sizeof(float));
+    SkeletonPose *pose;
+    unsigned int i;
+    if (posix_memalign((void **) &pose, CACHE_LINE_SIZE, size)) return NULL;
+    pose->skeleton = skeleton;
+    pose->bones = (float *) ((char *) pose + matrices);
+    pose->palette = pose->bones + n * 16;
+    pose->rotations = (HPMquat *) (pose->palette + n * 16);
+    pose->positions = (HPMpoint *) (pose->rotations + n);
+    pose->scales = (float *) (pose->positions + n);
+    pose->radius = radius;
+    for (i = 0; i < n; i++){
+        pose->positions[i].x = pose->positions[i].y = pose->positions[i].z = 0;
+        pose->rotations[i].x = pose->rotations[i].y = pose->rotations[i].z = 0;
+        pose->rotations[i].w = 1;
+        pose->scales[i] = 1;
+    }
+    memset(&pose->bounds, 0, sizeof(BoundingSphere));
+    pose->bounds.r = radius;
+    return pose;
+}
+
+HPSnode *hpsAddSkeletonInstance(HPSnode *parent, HPSskeleton *skeleton, float radius,
+                                void *data, HPSpipeline *pipeline,
+                                void (*deleteFunc)(void *)){
+    SkeletonPose *pose = newPose(skeleton, radius);
+    if (!pose){
+        fprintf(stderr, "Could not allocate skeleton pose\n");
+        return NULL;
+    }
+    HPSnode *node = hpsNewNode(parent, data, pipeline, deleteFunc);
+    if (!node){
+        free(pose);
+        return NULL;
+    }
+    node->cold->skeleton = pose;
+    node->isSkeleton = true;
+    node->scene->partitionInterface->addNode(&node->partitionData,
+                                             node->scene->partitionStruct);
+    return node;
+}
+
+static bool isSkeleton(HPSnode *node, unsigned int bone){
+    if (!node->isSkeleton){
+        fprintf(stderr, "Node %p is not a skeleton\n", node);
+        return false;
+    }
+    if (bone >= node->cold->skeleton->skeleton->nBones){
+        fprintf(stderr, "Skeleton %p does not have a bone %u\n", node, bone);
+        return false;
+    }
+    return true;
+}
+
+void hpsSetBonePose(HPSnode *node, unsigned int bone, float *position, float *rotation,
+                    float scale){
+    if (!isSkeleton(node, bone)) return;
+    SkeletonPose *pose = node->cold->skeleton;
+    memcpy(&pose->positions[bone], position, sizeof(HPMpoint));
+    memcpy(&pose->rotations[bone], rotation, sizeof(HPMquat));
+    pose->scales[bone] = scale;
+    node->needsUpdate = true;
+}
+
+float *hpsSkeletonPalette(HPSnode *node, unsigned int *nBones){
+    if (!isSkeleton(node, 0)) return NULL;
+    *nBones = node->cold->skeleton->skeleton->nBones;
+    return node->cold->skeleton->palette;
+}
+
+/* r = a * b, written column by column so that each column is a vector operation */
+static inline void multiply(const float *restrict a, const float *restrict b,
+                            float *restrict r){
+    int i, j, k;
+    for (j = 0; j < 4; j++){
+        float col[4] = {0, 0, 0, 0};
+        for (k = 0; k < 4; k++)
+            for (i = 0; i < 4; i++)
+                col[i] += a[k * 4 + i] * b[j * 4 + k];
+        for (i = 0; i < 4; i++)
+            r[j * 4 + i] = col[i];
+    }
+}
+
+static inline void localTransform(HPMpoint *p, HPMquat *q, float s, float *m){
+    float xx = q->x * q->x, yy = q->y * q->y, zz = q->z * q->z;
+    float xy = q->x * q->y, xz = q->x * q->z, yz = q->y * q->z;
+    float xw = q->x * q->w, yw = q->y * q->w, zw = q->z * q->w;
+    m[0] = s * (1 - 2 * (yy + zz));
+    m[1] = s * 2 * (xy + zw);
+    m[2] = s * 2 * (xz - yw);
+    m[3] = 0;
+    m[4] = s * 2 * (xy - zw);
+    m[5] = s * (1 - 2 * (xx + zz));
+    m[6] = s * 2 * (yz + xw);
+    m[7] = 0;
+    m[8] = s * 2 * (xz + yw);
+    m[9] = s * 2 * (yz - xw);
+    m[10] = s * (1 - 2 * (xx + yy));
+    m[11] = 0;
+    m[12] = p->x;
+    m[13] = p->y;
+    m[14] = p->z;
+    m[15] = 1;
+}
+
+/* Bounds of the bones' origins, padded by the skeleton's radius */
+static void updateBounds(SkeletonPose *pose, unsigned int nBones){
+    float min[3] = {INFINITY, INFINITY, INFINITY};
+    float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+    float r = 0;
+    unsigned int i, j;
+    if (!nBones) return;
+    for (i = 0; i < nBones; i++){
+        float *origin = &pose->bones[i * 16 + 12];
+        for (j = 0; j < 3; j++){
+            min[j] = fminf(min[j], origin[j]);
+            max[j] = fmaxf(max[j], origin[j]);
+        }
+    }
+    pose->bounds.x = (min[0] + max[0]) * 0.5;
+    pose->bounds.y = (min[1] + max[1]) * 0.5;
+    pose->bounds.z = (min[2] + max[2]) * 0.5;
+    for (i = 0; i < nBones; i++){
+        float *origin = &pose->bones[i * 16 + 12];
+        float dx = origin[0] - pose->bounds.x, dy = origin[1] - pose->bounds.y,
+            dz = origin[2] - pose->bounds.z;
+        r = fmaxf(r, dx*dx + dy*dy + dz*dz);
+    }
+    pose->bounds.r = sqrtf(r) + pose->radius;
+}
+
+void hpsPoseSkeleton(SkeletonPose *pose){
+    HPSskeleton *skeleton = pose->skeleton;
+    unsigned int n = skeleton->nBones;
+    unsigned int i;
+    float local[16];
+    for (i = 0; i < n; i++){
+        float *bone = &pose->bones[i * 16];
+        int parent = skeleton->parents[i];
+        if (parent < 0){
+            localTransform(&pose->positions[i], &pose->rotations[i], pose->scales[i], bone);
+        } else {
+            localTransform(&pose->positions[i], &pose->rotations[i], pose->scales[i], local);
+            multiply(&pose->bones[parent * 16], local, bone);
+        }
+    }
+    for (i = 0; i < n; i++)
+        multiply(&pose->bones[i * 16], &skeleton->inverseBindMatrices[i * 16],
+                 &pose->palette[i * 16]);
+    updateBounds(pose, n);
+}
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "scene.h"
+
+/*
+  Snapshots only store what changes. Every node keeps the position and rotation it had as of the newest snapshot, and nodes that are modified are pushed to the scene's changedNodes vector. When the next snapshot is taken, the saved state of each changed node is recorded in the previous snapshot, which is then all that is needed to roll back to it.
+ */
+
+static void saveNode(HPSnode *node){
+    int i;
+    node->cold->savedPosition = node->cold->position;
+    node->cold->savedRotation = node->cold->rotation;
+    node->cold->changedSinceSnapshot = false;
+    for (i = 0; i < node->children.size; i++)
+        saveNode(node->children.data[i]);
+}
+
+static void pushRecord(HPSsnapshot *snapshot, HPSnode *node){
+    if (snapshot->nRecords == snapshot->capacity){
+        snapshot->capacity = snapshot->capacity ? snapshot->capacity * 2 : 64;
+        snapshot->records = realloc(snapshot->records,
+                                    snapshot->capacity * sizeof(SnapshotRecord));
+    }
+    SnapshotRecord *r = &snapshot->records[snapshot->nRecords++];
+    r->node = node;
+    r->position = node->cold->savedPosition;
+    r->rotation = node->cold->savedRotation;
+}
+
+static void freeSnapshot(HPSsnapshot *snapshot){
+    free(snapshot->records);
+    free(snapshot);
+}
+
+HPSsnapshot *hpsSnapshotScene(HPSscene *scene){
+    HPSsnapshot *newest = scene->newestSnapshot;
+    int i;
+    if (newest){
+        for (i = 0; i < scene->changedNodes.size; i++){
+            HPSnode *node = scene->changedNodes.data[i];
+            pushRecord(newest, node);
+            node->cold->savedPosition = node->cold->position;
+            node->cold->savedRotation = node->cold->rotation;
+            node->cold->changedSinceSnapshot = false;
+        }
+        scene->changedNodes.size = 0;
+    } else {
+        for (i = 0; i < scene->topLevelNodes.size; i++)
+            saveNode(scene->topLevelNodes.data[i]);
+    }
+    HPSsnapshot *snapshot = malloc(sizeof(HPSsnapshot));
+    snapshot->scene = scene;
+    snapshot->older = newest;
+    snapshot->newer = NULL;
+    snapshot->records = NULL;
+    snapshot->nRecords = 0;
+    snapshot->capacity = 0;
+    if (newest) newest->newer = snapshot;
+    scene->newestSnapshot = snapshot;
+    return snapshot;
+}
+
+void hpsRestoreScene(HPSscene *scene, HPSsnapshot *snapshot){
+    HPSsnapshot *s;
+    int i;
+    if (snapshot->scene != scene){
+        fprintf(stderr, "Snapshot %p was not taken of scene %p\n", snapshot, scene);
+        return;
+    }
+    for (i = 0; i < scene->changedNodes.size; i++){
+        HPSnode *node = scene->changedNodes.data[i];
+        node->cold->position = node->cold->savedPosition;
+        node->cold->rotation = node->cold->savedRotation;
+        node->cold->changedSinceSnapshot = false;
+        node->needsUpdate = true;
+    }
+    scene->changedNodes.size = 0;
+    // Newer snapshots are applied first, so that the oldest state of a node wins
+    for (s = scene->newestSnapshot; s != snapshot;){
+        HPSsnapshot *older = s->older;
+        for (i = 0; i < older->nRecords; i++){
+            SnapshotRecord *r = &older->records[i];
+            HPSnode *node = r->node;
+            if (!node) continue; // Node was deleted
+            NodeCold *cold = node->cold;
+            cold->position = r->position;
+            cold->rotation = r->rotation;
+            cold->savedPosition = r->position;
+            cold->savedRotation = r->rotation;
+            node->needsUpdate = true;
+        }
+        freeSnapshot(s);
+        s = older;
+    }
+    snapshot->newer = NULL;
+    snapshot->nRecords = 0;
+    scene->newestSnapshot = snapshot;
+}
+
+/* Called while deleted nodes are still allocated, so that no snapshot holds on to them */
+void hpsRemoveDeletedRecords(HPSscene *scene){
+    HPSsnapshot *s;
+    int i;
+    for (s = scene->newestSnapshot; s; s = s->older)
+        for (i = 0; i < s->nRecords; i++)
+            if (s->records[i].node && s->records[i].node->isDeleted)
+                s->records[i].node = NULL;
+}
+
+void hpsDeleteSnapshot(HPSsnapshot *snapshot){
+    HPSscene *scene = snapshot->scene;
+    HPSsnapshot *newer = snapshot->newer;
+    HPSsnapshot *s = snapshot;
+    int i;
+    while (s){
+        HPSsnapshot *older = s->older;
+        freeSnapshot(s);
+        s = older;
+    }
+    if (newer){
+        newer->older = NULL;
+    } else {
+        for (i = 0; i < scene->changedNodes.size; i++)
+            ((HPSnode *) scene->changedNodes.data[i])->cold->changedSinceSnapshot = false;
+        scene->changedNodes.size = 0;
+        scene->newestSnapshot = NULL;
+    }
+}
+
+void hpsDeleteSnapshots(HPSscene *scene){
+    if (scene->newestSnapshot)
+        hpsDeleteSnapshot(scene->newestSnapshot);
+}
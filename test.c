@@ -69,3 +69,74 @@ CHEAT_TEST(pool,
            cheat_assert(*second = 2);
            cheat_assert(*third = 3);
     )
+
+CHEAT_TEST(pool_delete_many,
+           HPSpool pool = hpsMakePool(sizeof(int), 4, "test pool");
+           void *blocks[4];
+           int i;
+           for (i = 0; i < 4; i++)
+               blocks[i] = hpsAllocateFrom(pool);
+           hpsDeleteManyFrom(blocks, 3, pool);
+           cheat_assert(hpsAllocateFrom(pool) == blocks[0]);
+           cheat_assert(hpsAllocateFrom(pool) == blocks[1]);
+           cheat_assert(hpsAllocateFrom(pool) == blocks[2]);
+           cheat_assert(((struct pool*) pool)->nextPool == NULL);
+           hpsDeletePool(pool);
+    )
+
+CHEAT_TEST(pool_in_region,
+           char region[sizeof(struct pool) + 3 * sizeof(void *)];
+           HPSpool pool = hpsMakePoolIn(region, sizeof(region), sizeof(int), "test pool");
+           cheat_assert(pool == (HPSpool) region);
+           cheat_assert(((struct pool*) pool)->nBlocks == 3);
+           void *first = hpsAllocateFrom(pool);
+           void *second = hpsAllocateFrom(pool);
+           void *third = hpsAllocateFrom(pool);
+           cheat_assert(third != NULL);
+           cheat_assert(hpsAllocateFrom(pool) == NULL); // Fixed pools can't grow
+           cheat_assert(hpsPoolBlockIndex(pool, first) == 0);
+           cheat_assert(hpsPoolBlockIndex(pool, second) == 1);
+           hpsDeleteFrom(second, pool);
+           cheat_assert(hpsAllocateFrom(pool) == second);
+           hpsDeletePool(pool);
+    )
+
+CHEAT_TEST(pool_block_index,
+           HPSpool pool = hpsMakePool(sizeof(int), 2, "test pool");
+           hpsAllocateFrom(pool);
+           hpsAllocateFrom(pool);
+           void *grown = hpsAllocateFrom(pool);
+           int other;
+           cheat_assert(((struct pool*) pool)->nextPool != NULL);
+           cheat_assert(hpsPoolBlockIndex(pool, grown) == 2);
+           cheat_assert(hpsPoolBlockIndex(pool, &other) == (size_t) -1);
+           hpsDeletePool(pool);
+    )
+
+CHEAT_TEST(pool_chunks,
+           HPSpool pool = hpsMakePool(sizeof(int), 2, "test pool");
+           size_t first, n;
+           void *a = hpsAllocateFrom(pool);
+           hpsAllocateFrom(pool);
+           void *grown = hpsAllocateFrom(pool);
+           cheat_assert(hpsPoolChunk(pool, 0, &first, &n) == a);
+           cheat_assert(first == 0 && n == 2);
+           cheat_assert(hpsPoolChunk(pool, 1, &first, &n) == grown);
+           cheat_assert(first == 2 && n == 2);
+           cheat_assert(hpsPoolChunk(pool, 2, &first, &n) == NULL);
+           hpsDeletePool(pool);
+    )
+
+CHEAT_TEST(pool_clear,
+           HPSpool pool = hpsMakePool(sizeof(int), 2, "test pool");
+           int i;
+           for (i = 0; i < 4; i++)
+               hpsAllocateFrom(pool);
+           hpsClearPool(pool);
+           for (i = 0; i < 4; i++)
+               hpsAllocateFrom(pool);
+           struct pool *grown = ((struct pool*) pool)->nextPool;
+           cheat_assert(grown != NULL);
+           cheat_assert(grown->nextPool == NULL); // The grown chunk was reused
+           hpsDeletePool(pool);
+    )